@@ -0,0 +1,1292 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <array>
+#include <bitset>
+#include <climits>
+#include <deque>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "logger.hpp"
+
+// 47x47 eight-colour barcode: marker detection, alignment and decoding, shared by the barcode tool and the
+// barcode_test benchmark.
+
+using namespace cv;
+using namespace std;
+
+inline int gridSize = 47;
+inline size_t maxDecodeLength = 1050;
+
+// Debug images (debug_centers.jpg and debug-rotated.jpg) are only written with --debug, for every debugImageInterval-th frame.
+// Each call is told whether to write them, so decodes on other threads never share the decision.
+inline int debugImageInterval = 1;
+
+// Color map for 8 colors to avoid magic strings
+struct ColorMap
+{
+	const Vec3b black = {0, 0, 0};
+	const Vec3b blue = {255, 0, 0};
+	const Vec3b green = {0, 255, 0};
+	const Vec3b red = {0, 0, 255};
+	const Vec3b cyan = {255, 255, 0};
+	const Vec3b magenta = {255, 0, 255};
+	const Vec3b yellow = {0, 255, 255};
+	const Vec3b white = {255, 255, 255};
+};
+inline ColorMap colorMap;
+struct Vec3bComparator
+{
+	bool operator()(const Vec3b &a, const Vec3b &b) const
+	{
+		if (a[0] != b[0])
+		{
+			return a[0] < b[0];
+		}
+		if (a[1] != b[1])
+		{
+			return a[1] < b[1];
+		}
+
+		return a[2] < b[2];
+	}
+};
+
+/// @brief Get color name
+/// @param color Color bgr
+/// @return color as string
+inline string getColorName(const Vec3b &color)
+{
+	if (color == colorMap.black)
+	{
+		return "black";
+	}
+	if (color == colorMap.blue)
+	{
+		return "blue";
+	}
+	if (color == colorMap.green)
+	{
+		return "green";
+	}
+	if (color == colorMap.cyan)
+	{
+		return "cyan";
+	}
+	if (color == colorMap.red)
+	{
+		return "red";
+	}
+	if (color == colorMap.magenta)
+	{
+		return "magenta";
+	}
+	if (color == colorMap.yellow)
+	{
+		return "yellow";
+	}
+	if (color == colorMap.white)
+	{
+		return "white";
+	}
+	return "unknown";
+}
+// Encdoing Array table. First chracter is space.
+inline char encodingArray[64] = {
+		' ', 'a', 'b', 'c', 'd', 'e', 'f', 'g',
+		'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o',
+		'p', 'q', 'r', 's', 't', 'u', 'v', 'x',
+		'y', 'w', 'z', 'A', 'B', 'C', 'D', 'E',
+		'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M',
+		'N', 'O', 'P', 'Q', 'R', 'S', 'T', 'U',
+		'V', 'X', 'Y', 'W', 'Z',
+		'0', '1', '2', '3', '4', '5', '6', '7',
+		'8', '9', '.'};
+
+inline map<Vec3b, string, Vec3bComparator> eightColorMap = {
+		{colorMap.black, "000"},
+		{colorMap.blue, "001"},
+		{colorMap.green, "010"},
+		{colorMap.cyan, "011"},
+		{colorMap.red, "100"},
+		{colorMap.magenta, "101"},
+		{colorMap.yellow, "110"},
+		{colorMap.white, "111"}};
+
+/// @brief The marker zone is the 6x6 square in the top-left, bottom-left, and bottom-right corners of the barcode.
+/// @param row Grid row
+/// @param col Grid column
+/// @return return true if the square is in the marker zone, otherwise false
+inline bool isInMarkerZone(int row, int col)
+{
+	// 6x6 markers excluded in 47x47 grid
+	return (row < 6 && col < 6) ||	 // top-left marker
+				 (row >= 41 && col < 6) || // bottom-left marker
+				 (row >= 41 && col >= 41); // bottom-right marker
+}
+
+/// @brief The decoding is composed of 8 colors code, we need to find the closest color
+/// @param pixel  The pixel color to find the closest color for
+/// @return The closest color in the colorMap
+inline Vec3b findClosestColor(Vec3b pixel)
+{
+	Vec3b closestColor = {0, 0, 0};
+	int minDist = INT_MAX;
+
+	for (const auto &color : eightColorMap)
+	{
+		Vec3i pixelInt = Vec3i(pixel);
+		Vec3i colorInt = Vec3i(color.first);
+
+		// Euclidean distance to find the distance betwen pixels
+		int dist = norm(pixelInt - colorInt);
+
+		if (dist < minDist)
+		{
+			minDist = dist;
+			closestColor = colorInt;
+		}
+	}
+	return closestColor;
+}
+
+// The colour lookup table uses the top 5 bits of each channel: 32 * 32 * 32 = 32 KB.
+const int colorTableBits = 5;
+
+/// @brief Lookup table from a BGR pixel to its 3 bit color code (the bits of eightColorMap), filled once from findClosestColor at the
+/// center of every bin. The nearest of the 8 colors is decided per channel at 127.5, which is a bin boundary, so the table
+/// agrees with findClosestColor.
+/// @return table indexed by colorTableIndex()
+inline const array<uint8_t, 1 << (3 * colorTableBits)> &getColorCodeTable()
+{
+	static const array<uint8_t, 1 << (3 * colorTableBits)> table = []()
+	{
+		array<uint8_t, 1 << (3 * colorTableBits)> codes;
+		const int shift = 8 - colorTableBits;
+		for (int index = 0; index < static_cast<int>(codes.size()); index++)
+		{
+			Vec3b center(((index >> (2 * colorTableBits)) << shift) + (1 << (shift - 1)),
+									 (((index >> colorTableBits) & ((1 << colorTableBits) - 1)) << shift) + (1 << (shift - 1)),
+									 ((index & ((1 << colorTableBits) - 1)) << shift) + (1 << (shift - 1)));
+			codes[index] = static_cast<uint8_t>(stoi(eightColorMap.at(findClosestColor(center)), nullptr, 2));
+		}
+		return codes;
+	}();
+	return table;
+}
+
+/// @brief The 3 bit color code of a pixel: 4 red, 2 green, 1 blue, as in eightColorMap
+/// @param table getColorCodeTable()
+/// @param pixel BGR pixel
+/// @return color code 0..7
+inline uint8_t getColorCode(const array<uint8_t, 1 << (3 * colorTableBits)> &table, Vec3b pixel)
+{
+	const int shift = 8 - colorTableBits;
+	return table[((pixel[0] >> shift) << (2 * colorTableBits)) | ((pixel[1] >> shift) << colorTableBits) | (pixel[2] >> shift)];
+}
+
+/// @brief The color of a 3 bit color code
+/// @param code color code 0..7
+/// @return BGR color
+inline Vec3b getCodeColor(uint8_t code)
+{
+	return Vec3b((code & 1) ? 255 : 0, (code & 2) ? 255 : 0, (code & 4) ? 255 : 0);
+}
+
+/// @brief Detect the area of the barcode in the image. This is necessary as the square is bordered with a black border
+/// @param image The input image to detect the barcode area
+/// @return The bounding rectangle of the detected barcode area
+inline Rect detectBarcodeArea(const Mat &image)
+{
+	Mat gray, thresh;
+	cvtColor(image, gray, COLOR_BGR2GRAY);
+	threshold(gray, thresh, 220, 255, THRESH_BINARY_INV);
+
+	// Find the whole part
+	Mat kernel = getStructuringElement(MORPH_RECT, Size(3, 3));
+	morphologyEx(thresh, thresh, MORPH_CLOSE, kernel);
+
+	vector<Point> points;
+	// Find all white pixels
+	findNonZero(thresh, points);
+
+	if (points.empty())
+	{
+		return Rect();
+	}
+
+	return boundingRect(points);
+}
+
+/// @brief Confidence of a cell color: how far the closest channel is from the 127.5 threshold between 0 and 255.
+/// @param blue mean blue
+/// @param green mean green
+/// @param red mean red
+/// @return margin from 0 (undecidable) to 1 (pure color)
+inline double getColorMargin(double blue, double green, double red)
+{
+	return min({abs(blue - 127.5), abs(green - 127.5), abs(red - 127.5)}) / 127.5;
+}
+
+/// @brief Combine the 3 bit color codes of the data cells into the string
+/// @param codes color code of every data cell, in row order
+/// @return Decoded string, at most maxDecodeLength characters
+inline string decodeCellCodes(const vector<uint8_t> &codes)
+{
+	// Debug big list, one line per grid row so each message fits the log buffer
+#if BARCODE_LOG_LEVEL >= 3
+	if (logger().enabled(LogLevel::Debug))
+	{
+		for (size_t i = 0; i < codes.size(); i += gridSize)
+		{
+			ostringstream line;
+			for (size_t j = i; j < min(codes.size(), i + gridSize); j++)
+			{
+				line << bitset<3>(codes[j]) << " ";
+			}
+			LOG_DEBUG("[decodeBarcode]: Bits list: " << line.str());
+		}
+	}
+#endif
+
+	// Combine the bits into a single string
+	string decoded;
+	decoded.reserve(codes.size() / 2);
+	for (size_t i = 0; i + 1 < codes.size(); i += 2)
+	{
+		// Symbol is composed of two colors, the first one is the high 3 bits
+		decoded += encodingArray[(codes[i] << 3) | codes[i + 1]];
+	}
+
+	for (size_t i = 0; i < decoded.size(); i += 350)
+	{
+		LOG_DEBUG("[decodeBarcode]: Decoded string: " << decoded.substr(i, 350));
+	}
+
+	// Ensure exactly 1050 characters
+	if (decoded.length() > maxDecodeLength)
+	{
+		LOG_INFO("[Decode] Trimming to 1050 characters");
+		decoded = decoded.substr(0, maxDecodeLength);
+	}
+
+	return decoded;
+}
+
+/// @brief Decode the cells of the barcode area into the string
+/// @param area bounding box of the barcode, black border included, in aligned image coordinates
+/// @param sampleWindowFraction fraction of the cell width and height of the window passed to sampleCell
+/// @param sampleCell sampleCell(center, windowWidth, windowHeight) returns the mean BGR color of the window around a cell center
+/// @param cellMargins optional, the getColorMargin() of every data cell
+/// @param cellCodes optional, the 3 bit color code of every data cell
+/// @return Decoded string
+template <typename CellSampler>
+string decodeCells(Rect area, double sampleWindowFraction, CellSampler sampleCell, vector<double> *cellMargins, vector<uint8_t> *cellCodes = nullptr)
+{
+	double squareWidth = area.width / static_cast<double>(gridSize);
+	double squareHeight = area.height / static_cast<double>(gridSize);
+	double offsetX = area.x;
+	double offsetY = area.y;
+	int windowWidth = max(1, static_cast<int>(round(sampleWindowFraction * squareWidth)));
+	int windowHeight = max(1, static_cast<int>(round(sampleWindowFraction * squareHeight)));
+
+	// 3 bit color code of every data cell; two cells make one 6 bit symbol
+	const array<uint8_t, 1 << (3 * colorTableBits)> &colorCodeTable = getColorCodeTable();
+	vector<uint8_t> codes;
+	codes.reserve(gridSize * gridSize);
+	if (cellMargins)
+	{
+		cellMargins->clear();
+		cellMargins->reserve(gridSize * gridSize);
+	}
+
+	// Debug
+	LOG_DEBUG("[decodeBarcode]: Border Rectangle: x=" << area.x << ", y=" << area.y << ", w=" << area.width << ", h=" << area.height);
+	LOG_DEBUG("[decodeBarcode]: Square size: " << squareWidth << "x" << squareHeight);
+	LOG_DEBUG("[decodeBarcode]: Offset: " << offsetX << ", " << offsetY);
+
+	for (int row = 0; row < gridSize; row++)
+	{
+		for (int col = 0; col < gridSize; col++)
+		{
+			// 6x6 markers excluded in 47x47 grid; one top-left, one bottom-left, and one bottom-right
+			if (isInMarkerZone(row, col))
+			{
+				continue;
+			}
+
+			double x0 = offsetX + col * squareWidth;
+			double x1 = offsetX + (col + 1) * squareWidth;
+			double y0 = offsetY + row * squareHeight;
+			double y1 = offsetY + (row + 1) * squareHeight;
+
+			// We are picking up the pixel in the middle of the square box
+			Point center(round((x0 + x1) / 2.0), round((y0 + y1) / 2.0));
+
+			Vec3d mean = sampleCell(center, windowWidth, windowHeight);
+			Vec3b pixel(saturate_cast<uchar>(mean[0]), saturate_cast<uchar>(mean[1]), saturate_cast<uchar>(mean[2]));
+			double margin = getColorMargin(mean[0], mean[1], mean[2]);
+			if (cellMargins)
+			{
+				cellMargins->push_back(margin);
+			}
+
+			// Quantize the pixel color to the closest color in the 8 color map, as its 3 bits
+			uint8_t code = getColorCode(colorCodeTable, pixel);
+
+			// Debug
+			LOG_DEBUG("[decodeBarcode]: square (" << col << "," << row << ") center: " << center
+																						<< " pixel (BGR): (" << (int)pixel[0] << "," << (int)pixel[1] << "," << (int)pixel[2] << ")"
+																						<< " color: " << getColorName(getCodeColor(code)) << " bits: " << bitset<3>(code) << " margin: " << margin);
+
+			codes.push_back(code);
+		}
+	}
+
+	string decoded = decodeCellCodes(codes);
+	if (cellCodes)
+	{
+		*cellCodes = move(codes);
+	}
+	return decoded;
+}
+
+/// @brief Decode the barcode from the provided image.
+/// @details With sampleWindowFraction > 0 every cell is the mean of its central sub-window, read in O(1) from per-channel
+/// integral images built once per image, so a single noisy pixel does not flip the cell.
+/// @param image Image
+/// @param cellMargins optional, the getColorMargin() of every data cell
+/// @param cellCodes optional, the 3 bit color code of every data cell
+/// @param writeDebugImages write debug_centers.jpg
+/// @param sampleWindowFraction fraction of the cell width and height averaged around each cell center (--sample). 0 reads
+/// the single center pixel.
+/// @return Decoded string
+inline string decodeBarcode(const Mat &image, vector<double> *cellMargins = nullptr, vector<uint8_t> *cellCodes = nullptr, bool writeDebugImages = false,
+														double sampleWindowFraction = 0.0)
+{
+	// Check the offset of the image. Because the image is filled with black border, we need to exclude rough border width
+	Rect roughBorderRectangle = detectBarcodeArea(image);
+	LOG_DEBUG("[decodeBarcode]: Image size: " << image.cols << "x" << image.rows);
+
+	// Per-channel integral images for the sub-window means. Sums of a 3 channel 8 bit image fit CV_32S up to 8.4M pixels.
+	Mat sums;
+	if (sampleWindowFraction > 0.0)
+	{
+		if (image.total() > static_cast<size_t>(INT_MAX / 255))
+		{
+			throw invalid_argument("[decodeBarcode] [Error]: Image too large for sub-window sampling");
+		}
+		integral(image, sums, CV_32S);
+	}
+
+	// Debug
+	Mat debugImg;
+	if (writeDebugImages)
+	{
+		debugImg = image.clone();
+	}
+
+	string decoded = decodeCells(roughBorderRectangle, sampleWindowFraction, [&](Point center, int windowWidth, int windowHeight)
+															 {
+																 // Debug
+																 // Add a small dot to the image so that we can see center of the square is calculated right
+																 // Which can be seen in debug image debug_centers.jpg under 'build' folder
+																 if (writeDebugImages)
+																 {
+																	 circle(debugImg, center, 5, Scalar(0, 0, 255), FILLED);
+																 }
+
+																 if (sampleWindowFraction <= 0.0)
+																 {
+																	 return Vec3d(image.at<Vec3b>(center));
+																 }
+
+																 // Mean of the central sub-window: four integral image reads per channel
+																 Rect window = Rect(center.x - windowWidth / 2, center.y - windowHeight / 2, windowWidth, windowHeight) & Rect(0, 0, image.cols, image.rows);
+																 Vec3i sum = sums.at<Vec3i>(window.y + window.height, window.x + window.width) - sums.at<Vec3i>(window.y, window.x + window.width) -
+																						 sums.at<Vec3i>(window.y + window.height, window.x) + sums.at<Vec3i>(window.y, window.x);
+																 return Vec3d(sum) / max(1, window.area()); },
+															 cellMargins, cellCodes);
+
+	// Debug to check the if the centers are calculated right
+	if (writeDebugImages)
+	{
+		imwrite("debug_centers.jpg", debugImg);
+	}
+	return decoded;
+}
+
+/// @brief Check if the triangle is balanced
+/// @param ab Distance between A and B
+/// @param bc Distance between B and C
+/// @param ac Distance between A and C
+/// @return true if the triangle is balanced, otherwise false
+inline bool isTriangleDistanceBalanced(double ab, double bc, double ac)
+{
+	double maxDist = max({ab, bc, ac});
+	double minDist = min({ab, bc, ac});
+
+	return (maxDist / minDist < 2.5);
+}
+
+/// @brief Find the right angle of the marker triangle using Pythagorean Theorem a^2 + b^2 = c^2, within 5%
+/// @param a first marker
+/// @param b second marker
+/// @param c third marker
+/// @return 0, 1 or 2 for the marker at the right angle, -1 if there is none
+inline int findRightAngle(const Point2f &a, const Point2f &b, const Point2f &c)
+{
+	auto isRightTriangle = [](double a2, double b2, double c2)
+	{
+		double sum = a2 + b2;
+		double diff = abs(sum - c2);
+		return diff <= c2 * 0.05;
+	};
+
+	double ab2 = norm(a - b) * norm(a - b);
+	double ac2 = norm(a - c) * norm(a - c);
+	double bc2 = norm(b - c) * norm(b - c);
+	if (isRightTriangle(ab2, ac2, bc2))
+	{
+		return 0;
+	}
+	if (isRightTriangle(ab2, bc2, ac2))
+	{
+		return 1;
+	}
+	if (isRightTriangle(ac2, bc2, ab2))
+	{
+		return 2;
+	}
+	return -1;
+}
+
+/// @brief Find blue circles in a region of the image with HoughCircles on the blurred blue mask
+/// @param image Input image (BGR)
+/// @param region region to search
+/// @param minDistance minimum distance between circle centers, 0 for a fifth of the region height
+/// @param minRadius minimum radius
+/// @param maxRadius maximum radius
+/// @param accumulatorThreshold HoughCircles accumulator threshold, lower finds more (and more false) circles
+/// @param blurSize Gaussian blur of the mask, odd
+/// @return circles (x, y, radius) in image coordinates, strongest first
+inline vector<Vec3f> findBlueCircles(const Mat &image, Rect region, double minDistance, int minRadius, int maxRadius, int accumulatorThreshold = 35, int blurSize = 9)
+{
+	Mat hsv;
+	cvtColor(image(region), hsv, COLOR_BGR2HSV);
+	Mat mask;
+	inRange(hsv, Scalar(90, 30, 30), Scalar(140, 255, 255), mask);
+	GaussianBlur(mask, mask, Size(blurSize, blurSize), blurSize / 4.5);
+
+	vector<Vec3f> circles;
+	HoughCircles(mask, circles, HOUGH_GRADIENT, 1, minDistance > 0 ? minDistance : mask.rows / 5, 100, accumulatorThreshold, minRadius, maxRadius);
+
+	for (auto &c : circles)
+	{
+		c[0] += region.x;
+		c[1] += region.y;
+	}
+	return circles;
+}
+
+/// @brief Detect blue circles in a region of the image
+/// @param image Input image (BGR)
+/// @param region region to search
+/// @return circle centers in image coordinates
+inline vector<Point2f> detectBlueCircles(const Mat &image, Rect region)
+{
+	vector<Point2f> centers;
+	for (const auto &c : findBlueCircles(image, region, 0, 30, 50))
+	{
+		centers.emplace_back(c[0], c[1]);
+	}
+
+	return centers;
+}
+
+// Marker radius bands of the pyramid detection, in full resolution pixels: [16, 32], [32, 64], [64, 128] and [128, 256].
+// Band b is searched on pyramid level b + 1, where its circles are 8 to 16 pixels.
+const int pyramidMinRadius = 16;
+const int pyramidBands = 4;
+
+/// @brief Pick three markers that form a balanced triangle of circles of similar size
+/// @param circles candidate circles, strongest first
+/// @return 3 circles, or all of them if no such triangle exists
+inline vector<Vec3f> selectMarkerTriplet(const vector<Vec3f> &circles)
+{
+	for (size_t i = 0; i < circles.size(); i++)
+	{
+		for (size_t j = i + 1; j < circles.size(); j++)
+		{
+			for (size_t k = j + 1; k < circles.size(); k++)
+			{
+				Point2f a(circles[i][0], circles[i][1]), b(circles[j][0], circles[j][1]), c(circles[k][0], circles[k][1]);
+				float minRadius = min({circles[i][2], circles[j][2], circles[k][2]});
+				float maxRadius = max({circles[i][2], circles[j][2], circles[k][2]});
+				if (maxRadius < 1.5f * minRadius && isTriangleDistanceBalanced(norm(a - b), norm(b - c), norm(a - c)))
+				{
+					return {circles[i], circles[j], circles[k]};
+				}
+			}
+		}
+	}
+	return circles;
+}
+
+/// @brief Detect the blue markers coarse to fine: candidates of every radius band on a downscaled pyramid level, refined at
+/// full resolution only in a small window around each candidate.
+/// @details Finds markers from 16 to 256 pixels radius, so the code can be at any distance from the camera, and searches
+/// the whole frame at half resolution or less.
+/// @param image Input image (BGR)
+/// @return every marker circle (x, y, radius) found
+inline vector<Vec3f> findBlueCirclesPyramid(const Mat &image)
+{
+	Rect frameRect(0, 0, image.cols, image.rows);
+	vector<Vec3f> refined;
+	Mat level = image;
+	for (int band = 0; band < pyramidBands; band++)
+	{
+		pyrDown(level, level);
+		int scale = 2 << band;
+		int minRadius = pyramidMinRadius << band;
+		if (min(level.cols, level.rows) < 4 * minRadius / scale)
+		{
+			break;
+		}
+
+		// Low threshold on the coarse level: every candidate is checked again at full resolution
+		vector<Vec3f> candidates = findBlueCircles(level, Rect(0, 0, level.cols, level.rows), 2.0 * minRadius / scale, minRadius / scale, 2 * minRadius / scale, 15, 5);
+		for (const Vec3f &candidate : candidates)
+		{
+			Point2f center((candidate[0] + 0.5f) * scale - 0.5f, (candidate[1] + 0.5f) * scale - 0.5f);
+			float radius = candidate[2] * scale;
+			int window = cvRound(1.5f * radius) + 8;
+			Rect region = Rect(cvRound(center.x) - window, cvRound(center.y) - window, 2 * window, 2 * window) & frameRect;
+			vector<Vec3f> circles = findBlueCircles(image, region, 0, cvFloor(0.8f * radius), cvCeil(1.2f * radius) + 1);
+			if (circles.empty())
+			{
+				continue;
+			}
+
+			// A circle at a band boundary can be found in both bands
+			Vec3f circle = circles[0];
+			bool duplicate = any_of(refined.begin(), refined.end(), [&](const Vec3f &other)
+															{ return norm(Point2f(circle[0], circle[1]) - Point2f(other[0], other[1])) < other[2]; });
+			if (!duplicate)
+			{
+				refined.push_back(circle);
+			}
+		}
+	}
+
+	return refined;
+}
+
+/// @brief Detect the 3 blue markers with findBlueCirclesPyramid()
+/// @param image Input image (BGR)
+/// @return marker circles (x, y, radius), 3 if found
+inline vector<Vec3f> detectBlueCirclesPyramid(const Mat &image)
+{
+	return selectMarkerTriplet(findBlueCirclesPyramid(image));
+}
+
+/// @brief Detect 3 blue circles (top-left, bottom-left, bottom-right)
+/// @param image Input image (BGR)
+/// @param pyramidDetection search with detectBlueCirclesPyramid() for markers of any size (--pyramid)
+/// @return vector of 3 circle centers if found
+inline vector<Point2f> detectBlueCircles(const Mat &image, bool pyramidDetection = false)
+{
+	if (pyramidDetection)
+	{
+		vector<Point2f> centers;
+		for (const auto &c : detectBlueCirclesPyramid(image))
+		{
+			centers.emplace_back(c[0], c[1]);
+		}
+		return centers;
+	}
+	return detectBlueCircles(image, Rect(0, 0, image.cols, image.rows));
+}
+
+// Half size of the region searched around each predicted marker: the largest circle radius (50) plus room for the
+// prediction error. 240x240 pixels per marker instead of the whole frame.
+const int trackingSearchRadius = 120;
+
+/// @brief Struct to hold the markers tracked between camera frames.
+struct MarkerTracker
+{
+	bool tracking = false;
+	vector<Point2f> positions;
+	vector<Point2f> velocities; // Pixels per millisecond
+	float radius = 0.0f;				// Marker radius found by detectBlueCirclesPyramid(), 0 for the fixed 30 to 50 pixels
+	double lastTime = 0.0;
+	size_t fullSearches = 0;
+	size_t trackedFrames = 0;
+};
+
+/// @brief Detect the 3 blue circles of a camera frame, searching only small regions around their predicted positions
+/// once they have been found.
+/// @details The prediction assumes constant velocity since the last frame. A marker is the circle closest to its prediction.
+/// If a marker is not found, or the three no longer form a balanced triangle, tracking is lost and the whole frame is
+/// searched again.
+/// @param image camera frame (BGR)
+/// @param tracker MarkerTracker, updated
+/// @param time capture time of the frame in milliseconds
+/// @param pyramidDetection search the whole frame with detectBlueCirclesPyramid() for markers of any size
+/// @return circle centers, 3 if found
+inline vector<Point2f> trackBlueCircles(const Mat &image, MarkerTracker &tracker, double time, bool pyramidDetection = false)
+{
+	if (tracker.tracking)
+	{
+		double elapsed = time - tracker.lastTime;
+		Rect frameRect(0, 0, image.cols, image.rows);
+		vector<Point2f> found;
+		for (size_t i = 0; i < tracker.positions.size(); i++)
+		{
+			Point2f predicted = tracker.positions[i] + tracker.velocities[i] * elapsed;
+			int searchRadius = max(trackingSearchRadius, cvRound(2.5f * tracker.radius));
+			Rect region = Rect(cvRound(predicted.x) - searchRadius, cvRound(predicted.y) - searchRadius,
+												 2 * searchRadius, 2 * searchRadius) &
+										frameRect;
+			if (region.width < searchRadius || region.height < searchRadius)
+			{
+				break;
+			}
+
+			vector<Point2f> candidates;
+			if (tracker.radius > 0.0f)
+			{
+				for (const auto &c : findBlueCircles(image, region, 0, cvFloor(0.8f * tracker.radius), cvCeil(1.2f * tracker.radius) + 1))
+				{
+					candidates.emplace_back(c[0], c[1]);
+				}
+			}
+			else
+			{
+				candidates = detectBlueCircles(image, region);
+			}
+			if (candidates.empty())
+			{
+				break;
+			}
+			found.push_back(*min_element(candidates.begin(), candidates.end(), [&](const Point2f &a, const Point2f &b)
+																	 { return norm(a - predicted) < norm(b - predicted); }));
+		}
+
+		if (found.size() == 3 && isTriangleDistanceBalanced(norm(found[0] - found[1]), norm(found[1] - found[2]), norm(found[0] - found[2])))
+		{
+			for (size_t i = 0; i < found.size(); i++)
+			{
+				tracker.velocities[i] = elapsed > 0.0 ? (found[i] - tracker.positions[i]) / elapsed : Point2f();
+			}
+			tracker.positions = found;
+			tracker.lastTime = time;
+			tracker.trackedFrames++;
+			return found;
+		}
+
+		LOG_INFO("[trackBlueCircles]: Tracking lost, searching the whole frame");
+		tracker.tracking = false;
+	}
+
+	vector<Point2f> circles;
+	tracker.radius = 0.0f;
+	if (pyramidDetection)
+	{
+		vector<Vec3f> markers = detectBlueCirclesPyramid(image);
+		for (const auto &c : markers)
+		{
+			circles.emplace_back(c[0], c[1]);
+			tracker.radius += c[2] / markers.size();
+		}
+	}
+	else
+	{
+		circles = detectBlueCircles(image);
+	}
+	tracker.fullSearches++;
+	if (circles.size() == 3)
+	{
+		tracker.tracking = true;
+		tracker.positions = circles;
+		tracker.velocities.assign(circles.size(), Point2f());
+		tracker.lastTime = time;
+	}
+	return circles;
+}
+
+// Aligned image size and the size of the marker triangle in it. This canvas and region is based on the examples images
+const int alignedCanvasSize = 1200;
+const float alignedBarcodeRegion = 940.0f;
+
+/// @brief Affine transform from the image to the aligned image, from the three marker centers
+/// @param circles Blue circle centers from detectBlueCircles()
+/// @return 2x3 affine transform to an alignedCanvasSize square
+inline Mat getAlignmentTransform(const vector<Point2f> &circles)
+{
+	if (circles.size() != 3)
+	{
+		LOG_ERROR("[Align Image]: Found " << circles.size() << " circles, expected 3");
+		throw invalid_argument("[Align Image] [Error]: Could not find exactly three circles");
+	}
+
+	// Extract centers only; c[2] will be radius
+	vector<Point2f> centers;
+	for (const Point2f &c : circles)
+	{
+		centers.push_back(c);
+	}
+
+	// Determine right-angle triangle (bottom-left marker should be the right angle)
+	Point2f A = centers[0], B = centers[1], C = centers[2];
+	Point2f rightAngle, topLeft, bottomRight;
+	double distanceBetweenAB = norm(A - B);
+	double distanceBetweenAC = norm(A - C);
+	double distanceBetweenBC = norm(B - C);
+
+	// This is for the dynamic detection of the image through camera
+	if (!isTriangleDistanceBalanced(distanceBetweenAB, distanceBetweenBC, distanceBetweenAC))
+	{
+		LOG_ERROR("[Align Image]: Circle distances too unbalanced to form proper barcode frame.");
+		throw invalid_argument("Circle distances too unbalanced to form proper barcode frame.");
+	}
+
+	// Find the right angle using Pythagorean Theorem a^2 + b^2 = c^2
+	int rightAngleIndex = findRightAngle(A, B, C);
+	if (rightAngleIndex == 0)
+	{
+		rightAngle = A;
+		topLeft = B;
+		bottomRight = C;
+	}
+	else if (rightAngleIndex == 1)
+	{
+		rightAngle = B;
+		topLeft = A;
+		bottomRight = C;
+	}
+	else if (rightAngleIndex == 2)
+	{
+		rightAngle = C;
+		topLeft = A;
+		bottomRight = B;
+	}
+	else
+	{
+		LOG_ERROR("[Align Image]: No right-angle triangle found");
+		throw invalid_argument("[Align Image] [Error]: No right-angle triangle found");
+	}
+
+	// Explicitly assign top-left and bottom-right based on coordinates
+	// Top-left should have the smallest y-coordinate
+	// Bottom-right should have the largest x-coordinate
+	// This is to avoid the flip of the image
+	if (topLeft.y > bottomRight.y)
+	{
+		swap(topLeft, bottomRight);
+	}
+	if (topLeft.x > bottomRight.x)
+	{
+		swap(topLeft, bottomRight);
+	}
+
+	// Define source and destination points
+	vector<Point2f> src = {topLeft, rightAngle, bottomRight};
+
+	// Set destination points to a full-size square
+	float barcodeRegion = alignedBarcodeRegion;
+	float padding = (alignedCanvasSize - barcodeRegion) / 2.0f;
+
+	vector<Point2f> dst = {
+			Point2f(padding, padding),																// Top-left
+			Point2f(padding, padding + barcodeRegion),								// Bottom-left
+			Point2f(padding + barcodeRegion, padding + barcodeRegion) // Bottom-right
+	};
+
+	return getAffineTransform(src, dst);
+}
+
+/// @brief Align the image if the image is rotated
+/// @param image Input image
+/// @param circles Blue circle centers from detectBlueCircles()
+/// @param writeDebugImages write debug-rotated.jpg
+/// @return return aligned image
+inline Mat alignBarcodeImage(const Mat &image, const vector<Point2f> &circles, bool writeDebugImages = false)
+{
+	// Rotate based on the calculation
+	Mat affine = getAlignmentTransform(circles);
+	Mat aligned;
+	warpAffine(image, aligned, affine, Size(alignedCanvasSize, alignedCanvasSize), INTER_LINEAR, BORDER_CONSTANT, Scalar(255, 255, 255));
+
+	// Debug: Aligned image can be seen in debug-rotated.jpg under 'build' folder
+	if (writeDebugImages)
+	{
+		imwrite("debug-rotated.jpg", aligned);
+	}
+	return aligned;
+}
+
+/// @brief Align the image if the image is rotated
+/// @param image Input image
+/// @param writeDebugImages write debug-rotated.jpg
+/// @param pyramidDetection detect the markers with detectBlueCirclesPyramid()
+/// @return return aligned image
+inline Mat alignBarcodeImage(const Mat &image, bool writeDebugImages = false, bool pyramidDetection = false)
+{
+	// Detect blue color for more accuracy
+	return alignBarcodeImage(image, detectBlueCircles(image, pyramidDetection), writeDebugImages);
+}
+
+// Set by --direct: decode through the alignment transform instead of warping the image
+inline bool directSampling = false;
+
+// Scanlines per side used to find the barcode area without the aligned image
+const int areaScanlines = 32;
+
+/// @brief Bilinear sample of the image, white outside like the warpAffine border of alignBarcodeImage()
+/// @param image BGR image
+/// @param point position in the image
+/// @return BGR color
+inline Vec3d sampleBilinear(const Mat &image, Point2d point)
+{
+	int x = cvFloor(point.x);
+	int y = cvFloor(point.y);
+	double fx = point.x - x;
+	double fy = point.y - y;
+
+	auto pixel = [&](int px, int py)
+	{
+		if (px < 0 || py < 0 || px >= image.cols || py >= image.rows)
+		{
+			return Vec3d(255, 255, 255);
+		}
+		return Vec3d(image.at<Vec3b>(py, px));
+	};
+	return (pixel(x, y) * (1 - fx) + pixel(x + 1, y) * fx) * (1 - fy) + (pixel(x, y + 1) * (1 - fx) + pixel(x + 1, y + 1) * fx) * fy;
+}
+
+/// @brief Find the barcode area like detectBarcodeArea() does on the aligned image, but by walking scanlines from every side of
+/// the aligned canvas inwards to the first dark pixel, sampled through the inverse alignment transform.
+/// @param image Input image
+/// @param inverse aligned image to input image transform
+/// @return bounding box of the dark pixels in aligned image coordinates, empty if none was found
+inline Rect findBarcodeAreaDirect(const Mat &image, const Matx23d &inverse)
+{
+	auto isDark = [&](int x, int y)
+	{
+		Vec3d color = sampleBilinear(image, Point2d(inverse * Vec3d(x, y, 1.0)));
+		// Same gray and threshold as detectBarcodeArea()
+		return 0.114 * color[0] + 0.587 * color[1] + 0.299 * color[2] <= 220.0;
+	};
+
+	int left = alignedCanvasSize, right = -1, top = alignedCanvasSize, bottom = -1;
+	for (int line = 0; line < areaScanlines; line++)
+	{
+		int position = (2 * line + 1) * alignedCanvasSize / (2 * areaScanlines);
+		for (int x = 0; x < left; x++)
+		{
+			if (isDark(x, position))
+			{
+				left = x;
+				break;
+			}
+		}
+		for (int x = alignedCanvasSize - 1; x > right; x--)
+		{
+			if (isDark(x, position))
+			{
+				right = x;
+				break;
+			}
+		}
+		for (int y = 0; y < top; y++)
+		{
+			if (isDark(position, y))
+			{
+				top = y;
+				break;
+			}
+		}
+		for (int y = alignedCanvasSize - 1; y > bottom; y--)
+		{
+			if (isDark(position, y))
+			{
+				bottom = y;
+				break;
+			}
+		}
+	}
+
+	if (right < left || bottom < top)
+	{
+		return Rect();
+	}
+	return Rect(left, top, right - left + 1, bottom - top + 1);
+}
+
+/// @brief Decode the barcode straight from the input image: every cell center of the aligned grid is mapped through the
+/// inverse alignment transform and interpolated from the input, so nothing is warped, thresholded or closed and the cost
+/// depends on the number of cells instead of the image size.
+/// @details With sampleWindowFraction > 0 a cell is the mean of 3x3 bilinear samples spread over its central sub-window.
+/// @param image Input image
+/// @param affine alignment transform from getAlignmentTransform()
+/// @param cellMargins optional, the getColorMargin() of every data cell
+/// @param cellCodes optional, the 3 bit color code of every data cell
+/// @param writeDebugImages write debug_centers.jpg with the cell centers on the input image
+/// @param sampleWindowFraction fraction of the cell width and height averaged around each cell center (--sample). 0 reads
+/// the single center pixel.
+/// @return Decoded string
+inline string decodeBarcode(const Mat &image, const Mat &affine, vector<double> *cellMargins = nullptr, vector<uint8_t> *cellCodes = nullptr, bool writeDebugImages = false,
+														double sampleWindowFraction = 0.0)
+{
+	Mat inverseMat;
+	invertAffineTransform(affine, inverseMat);
+	Matx23d inverse = inverseMat;
+
+	Rect area = findBarcodeAreaDirect(image, inverse);
+	LOG_DEBUG("[decodeBarcode]: Image size: " << image.cols << "x" << image.rows << ", sampled through the alignment transform");
+
+	// Debug: the cell centers are drawn on the input image
+	Mat debugImg;
+	if (writeDebugImages)
+	{
+		debugImg = image.clone();
+	}
+
+	string decoded = decodeCells(area, sampleWindowFraction, [&](Point center, int windowWidth, int windowHeight)
+															 {
+																 if (writeDebugImages)
+																 {
+																	 circle(debugImg, Point2d(inverse * Vec3d(center.x, center.y, 1.0)), 5, Scalar(0, 0, 255), FILLED);
+																 }
+
+																 if (sampleWindowFraction <= 0.0)
+																 {
+																	 return sampleBilinear(image, Point2d(inverse * Vec3d(center.x, center.y, 1.0)));
+																 }
+
+																 Vec3d sum;
+																 for (int i = -1; i <= 1; i++)
+																 {
+																	 for (int j = -1; j <= 1; j++)
+																	 {
+																		 Vec3d point(center.x + j * windowWidth / 3.0, center.y + i * windowHeight / 3.0, 1.0);
+																		 sum += sampleBilinear(image, Point2d(inverse * point));
+																	 }
+																 }
+																 return sum / 9.0; },
+															 cellMargins, cellCodes);
+
+	if (writeDebugImages)
+	{
+		imwrite("debug_centers.jpg", debugImg);
+	}
+	return decoded;
+}
+
+// Frames whose votes are kept. Older frames drop out, so a different barcode in front of the camera takes over.
+const size_t voteWindowFrames = 8;
+
+/// @brief Margin weighted color votes of every data cell over the last voteWindowFrames decoded frames.
+/// @details Every frame adds the getColorMargin() of each cell to the color code it read, so a cell that is marginal in
+/// every single frame still becomes decidable once the frames agree. A clean frame leads by its margins on its own.
+/// The votes are accepted once every cell leads its runner-up by a confidence, given by the caller (--vote).
+struct CellVotes
+{
+	deque<pair<vector<uint8_t>, vector<double>>> frames;
+
+	/// @brief Add the cells of a decoded frame, dropping the oldest frame when the window is full
+	/// @param codes cellCodes of decodeBarcode()
+	/// @param margins cellMargins of decodeBarcode()
+	void add(const vector<uint8_t> &codes, const vector<double> &margins)
+	{
+		if (codes.size() != margins.size())
+		{
+			throw invalid_argument("[CellVotes] [Error]: " + to_string(codes.size()) + " cell codes but " + to_string(margins.size()) + " margins");
+		}
+		if (!frames.empty() && frames.front().first.size() != codes.size())
+		{
+			frames.clear();
+		}
+		frames.emplace_back(codes, margins);
+		if (frames.size() > voteWindowFrames)
+		{
+			frames.pop_front();
+		}
+	}
+
+	/// @brief Color code with the most votes of every cell
+	/// @param leads optional, how far the votes of each winning code are ahead of the runner-up
+	/// @return codes, empty without frames
+	vector<uint8_t> winningCodes(vector<double> *leads = nullptr) const
+	{
+		size_t cells = frames.empty() ? 0 : frames.front().first.size();
+		vector<uint8_t> codes(cells);
+		if (leads)
+		{
+			leads->assign(cells, 0.0);
+		}
+
+		for (size_t cell = 0; cell < cells; cell++)
+		{
+			array<double, 8> votes{};
+			for (const auto &frame : frames)
+			{
+				votes[frame.first[cell]] += frame.second[cell];
+			}
+
+			int best = 0;
+			double runnerUp = 0.0;
+			for (int code = 1; code < 8; code++)
+			{
+				if (votes[code] > votes[best])
+				{
+					runnerUp = votes[best];
+					best = code;
+				}
+				else
+				{
+					runnerUp = max(runnerUp, votes[code]);
+				}
+			}
+			codes[cell] = static_cast<uint8_t>(best);
+			if (leads)
+			{
+				(*leads)[cell] = votes[best] - runnerUp;
+			}
+		}
+		return codes;
+	}
+};
+
+/// @brief Struct to hold one of the barcodes decoded from a frame.
+struct DecodedBarcode
+{
+	vector<Point2f> markers;
+	string payload;
+	string error;
+	bool aligned = false; // The alignment succeeded, so an error comes from the decode
+};
+
+// Legs of a barcode's marker triangle may differ by this factor, so triplets mixing the markers of two codes are rejected
+const double maxMarkerLegRatio = 1.25;
+
+/// @brief Detect every blue circle of the image, of all barcodes in view. Unlike detectBlueCircles() the circles only have to be
+/// a diameter apart, so the markers of codes next to each other are not suppressed.
+/// @param image Input image (BGR)
+/// @param pyramidDetection search with findBlueCirclesPyramid() for markers of any size
+/// @return circle centers, strongest first
+inline vector<Point2f> detectAllBlueCircles(const Mat &image, bool pyramidDetection = false)
+{
+	vector<Point2f> centers;
+	vector<Vec3f> circles = pyramidDetection ? findBlueCirclesPyramid(image) : findBlueCircles(image, Rect(0, 0, image.cols, image.rows), 100, 30, 50);
+	for (const auto &c : circles)
+	{
+		centers.emplace_back(c[0], c[1]);
+	}
+	return centers;
+}
+
+/// @brief Group circles into the marker triplets of separate barcodes.
+/// @details A triplet has to pass isTriangleDistanceBalanced() and findRightAngle() like alignBarcodeImage() requires, and
+/// its two legs must be about equally long. The triplets closest to a right isosceles triangle are taken first, and
+/// every circle belongs to at most one barcode.
+/// @param circles circle centers, e.g. from detectAllBlueCircles()
+/// @return marker triplets
+inline vector<vector<Point2f>> groupMarkerTriplets(const vector<Point2f> &circles)
+{
+	struct Triplet
+	{
+		double score;
+		int i, j, k;
+	};
+
+	vector<Triplet> triplets;
+	int count = static_cast<int>(circles.size());
+	for (int i = 0; i < count; i++)
+	{
+		for (int j = i + 1; j < count; j++)
+		{
+			for (int k = j + 1; k < count; k++)
+			{
+				const Point2f &a = circles[i], &b = circles[j], &c = circles[k];
+				if (!isTriangleDistanceBalanced(norm(a - b), norm(b - c), norm(a - c)))
+				{
+					continue;
+				}
+				int rightAngleIndex = findRightAngle(a, b, c);
+				if (rightAngleIndex < 0)
+				{
+					continue;
+				}
+
+				// Legs from the right angle to the other two markers
+				const Point2f &corner = rightAngleIndex == 0 ? a : (rightAngleIndex == 1 ? b : c);
+				const Point2f &first = rightAngleIndex == 0 ? b : a;
+				const Point2f &second = rightAngleIndex == 2 ? b : c;
+				double firstLeg = norm(first - corner);
+				double secondLeg = norm(second - corner);
+				double legRatio = max(firstLeg, secondLeg) / max(1.0, min(firstLeg, secondLeg));
+				if (legRatio > maxMarkerLegRatio)
+				{
+					continue;
+				}
+
+				double hypotenuse2 = norm(first - second) * norm(first - second);
+				double rightAngleError = abs(firstLeg * firstLeg + secondLeg * secondLeg - hypotenuse2) / hypotenuse2;
+				triplets.push_back({legRatio - 1.0 + rightAngleError, i, j, k});
+			}
+		}
+	}
+
+	sort(triplets.begin(), triplets.end(), [](const Triplet &a, const Triplet &b)
+			 { return a.score < b.score; });
+
+	vector<bool> used(circles.size(), false);
+	vector<vector<Point2f>> groups;
+	for (const Triplet &triplet : triplets)
+	{
+		if (used[triplet.i] || used[triplet.j] || used[triplet.k])
+		{
+			continue;
+		}
+		used[triplet.i] = used[triplet.j] = used[triplet.k] = true;
+		groups.push_back({circles[triplet.i], circles[triplet.j], circles[triplet.k]});
+	}
+	return groups;
+}
+
+/// @brief Decode every barcode in view: the circles are grouped with groupMarkerTriplets() and each barcode is decoded on its
+/// own thread, through the alignment transform with directSampling or from its own aligned image otherwise.
+/// @details With more than one barcode no debug images are written, as the barcodes would overwrite each other's.
+/// @param image Input image (BGR)
+/// @param circles circle centers from detectAllBlueCircles()
+/// @param writeDebugImages write the debug images when there is a single barcode
+/// @param sampleWindowFraction fraction of the cell width and height averaged around each cell center, see decodeBarcode()
+/// @return one DecodedBarcode per triplet; payload is empty and error set when a barcode could not be decoded
+inline vector<DecodedBarcode> decodeBarcodes(const Mat &image, const vector<Point2f> &circles, bool writeDebugImages = false, double sampleWindowFraction = 0.0)
+{
+	vector<vector<Point2f>> groups = groupMarkerTriplets(circles);
+	vector<DecodedBarcode> barcodes(groups.size());
+
+	writeDebugImages = writeDebugImages && groups.size() == 1;
+	auto decodeGroup = [&](size_t index)
+	{
+		DecodedBarcode &barcode = barcodes[index];
+		barcode.markers = groups[index];
+		try
+		{
+			if (directSampling)
+			{
+				Mat affine = getAlignmentTransform(barcode.markers);
+				barcode.aligned = true;
+				barcode.payload = decodeBarcode(image, affine, nullptr, nullptr, writeDebugImages, sampleWindowFraction);
+			}
+			else
+			{
+				Mat aligned = alignBarcodeImage(image, barcode.markers, writeDebugImages);
+				barcode.aligned = true;
+				barcode.payload = decodeBarcode(aligned, nullptr, nullptr, writeDebugImages, sampleWindowFraction);
+			}
+		}
+		catch (const std::exception &e)
+		{
+			barcode.error = e.what();
+		}
+	};
+
+	if (groups.size() == 1)
+	{
+		decodeGroup(0);
+		return barcodes;
+	}
+
+	vector<thread> workers;
+	for (size_t i = 0; i < groups.size(); i++)
+	{
+		workers.emplace_back(decodeGroup, i);
+	}
+	for (thread &worker : workers)
+	{
+		worker.join();
+	}
+	return barcodes;
+}
+
+// Layout of encodeBarcode(): cells of barcodeCellSize pixels, a thin black border on the edge of the grid, a white
+// quiet zone around it, and a blue circle of markerRadius in the middle of every marker zone.
+const int barcodeCellSize = 20;
+const int barcodeQuietZone = 60;
+const int barcodeBorderWidth = 2;
+const int markerRadius = 40;
+
+/// @brief Encode text in the encodingArray alphabet into a barcode image that decodeBarcode() reads back.
+/// @details Every character is a 6 bit symbol, stored as two cells of 3 bit color codes (high bits first) in the order
+/// decodeBarcode() reads them. The text is padded with spaces to maxDecodeLength characters.
+/// @param text text, at most maxDecodeLength characters of encodingArray
+/// @return BGR image of (gridSize * barcodeCellSize + 2 * barcodeQuietZone) pixels square
+inline Mat encodeBarcode(const string &text)
+{
+	if (text.size() > maxDecodeLength)
+	{
+		throw invalid_argument("[encodeBarcode] [Error]: Text longer than " + to_string(maxDecodeLength) + " characters");
+	}
+
+	array<int, 256> symbols;
+	symbols.fill(-1);
+	for (int i = 0; i < 64; i++)
+	{
+		symbols[static_cast<unsigned char>(encodingArray[i])] = i;
+	}
+
+	vector<uint8_t> codes;
+	codes.reserve(gridSize * gridSize);
+	string padded = text + string(maxDecodeLength - text.size(), ' ');
+	for (char character : padded)
+	{
+		int symbol = symbols[static_cast<unsigned char>(character)];
+		if (symbol < 0)
+		{
+			throw invalid_argument(string("[encodeBarcode] [Error]: Character not in the encoding: ") + character);
+		}
+		codes.push_back(static_cast<uint8_t>(symbol >> 3));
+		codes.push_back(static_cast<uint8_t>(symbol & 7));
+	}
+
+	int gridPixels = gridSize * barcodeCellSize;
+	Mat image(gridPixels + 2 * barcodeQuietZone, gridPixels + 2 * barcodeQuietZone, CV_8UC3, Scalar(255, 255, 255));
+	size_t cell = 0;
+	for (int row = 0; row < gridSize; row++)
+	{
+		for (int col = 0; col < gridSize; col++)
+		{
+			if (isInMarkerZone(row, col))
+			{
+				continue;
+			}
+
+			// The cell left over after the last symbol is black
+			uint8_t code = cell < codes.size() ? codes[cell] : 0;
+			cell++;
+			Rect square(barcodeQuietZone + col * barcodeCellSize, barcodeQuietZone + row * barcodeCellSize, barcodeCellSize, barcodeCellSize);
+			image(square).setTo(getCodeColor(code));
+		}
+	}
+
+	// The border makes the grid the bounding box that detectBarcodeArea() finds
+	Rect grid(barcodeQuietZone, barcodeQuietZone, gridPixels, gridPixels);
+	rectangle(image, grid, Scalar(0, 0, 0), barcodeBorderWidth);
+
+	// Markers in the middle of the top-left, bottom-left and bottom-right 6x6 zones
+	int zoneCenter = 3 * barcodeCellSize;
+	int farZoneCenter = gridPixels - zoneCenter;
+	for (Point center : {Point(zoneCenter, zoneCenter), Point(zoneCenter, farZoneCenter), Point(farZoneCenter, farZoneCenter)})
+	{
+		circle(image, center + Point(barcodeQuietZone, barcodeQuietZone), markerRadius, Scalar(255, 0, 0), FILLED, LINE_AA);
+	}
+	return image;
+}
@@ -0,0 +1,374 @@
+#include <iostream>
+#include <iomanip>
+#include "barcode.hpp"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+
+// Decode benchmark of the barcode paths on a synthetic corpus.
+// Random texts are encoded with encodeBarcode() and put through increasing rotation, scale, perspective, blur, JPEG and
+// noise. Every decode path reports its success rate, character accuracy and throughput per distortion level.
+// Undistorted codes have to decode exactly on every path.
+// The camera cell voting is measured on consecutive frames of the same code, each distorted anew.
+// e.g. arguments - ./src/barcode_test 20
+//                  ./src/barcode_test 20 --corpus corpus    (also writes the images and corpus.jsonl for --batch)
+
+using namespace chrono;
+
+/// @brief Struct to hold the distortions of one corpus level. Each image draws its values uniformly up to these.
+struct DistortionLevel
+{
+	double rotation;	 // Degrees, either direction
+	double scale;			 // Relative change of the size, either direction
+	double perspective; // Corner displacement relative to the code size
+	double blur;			 // Gaussian sigma in pixels
+	int jpegQuality;	 // 0 for no JPEG compression
+	double noise;			 // Gaussian noise sigma in gray levels
+};
+
+const vector<DistortionLevel> distortionLevels = {
+		{0.0, 0.0, 0.0, 0.0, 0, 0.0},
+		{5.0, 0.05, 0.005, 0.5, 95, 2.0},
+		{15.0, 0.10, 0.01, 1.0, 85, 5.0},
+		{30.0, 0.15, 0.02, 1.5, 70, 8.0},
+		{45.0, 0.25, 0.03, 2.0, 50, 12.0}};
+
+// Frame the codes are placed in, large enough for the rotated and scaled code
+const Size corpusFrameSize(1600, 1600);
+
+/// @brief Struct to hold a generated corpus image with the payload it has to decode to.
+struct CorpusImage
+{
+	Mat image;
+	string payload;
+};
+
+/// @brief Struct to hold the result of one decode path on one level.
+struct VariantResult
+{
+	int decoded = 0;
+	int images = 0;
+	double characterAccuracy = 0.0;
+	double imagesPerSecond = 0.0;
+};
+
+/// @brief Random text of the encodingArray alphabet
+/// @param rng random number generator
+/// @return maxDecodeLength characters
+string generateRandomText(RNG &rng)
+{
+	string text(maxDecodeLength, ' ');
+	for (char &character : text)
+	{
+		character = encodingArray[rng.uniform(0, 64)];
+	}
+	return text;
+}
+
+/// @brief Encode a text and distort it like a camera frame of a printed code would
+/// @param payload text
+/// @param level DistortionLevel
+/// @param rng random number generator
+/// @return CorpusImage
+CorpusImage generateCorpusImage(const string &payload, const DistortionLevel &level, RNG &rng)
+{
+	CorpusImage corpusImage;
+	corpusImage.payload = payload;
+	Mat code = encodeBarcode(corpusImage.payload);
+
+	// Rotate and scale the code corners around the frame center, then move each corner for the perspective
+	double angle = rng.uniform(-level.rotation, level.rotation) * CV_PI / 180.0;
+	double scale = 1.0 + rng.uniform(-level.scale, level.scale);
+	Point2f codeCenter(code.cols / 2.0f, code.rows / 2.0f);
+	Point2f frameCenter(corpusFrameSize.width / 2.0f, corpusFrameSize.height / 2.0f);
+	vector<Point2f> source = {Point2f(0, 0), Point2f(code.cols, 0), Point2f(code.cols, code.rows), Point2f(0, code.rows)};
+	vector<Point2f> destination;
+	for (const Point2f &corner : source)
+	{
+		Point2f offset = (corner - codeCenter) * scale;
+		Point2f rotated(offset.x * cos(angle) - offset.y * sin(angle), offset.x * sin(angle) + offset.y * cos(angle));
+		Point2f jitter(rng.uniform(-1.0, 1.0), rng.uniform(-1.0, 1.0));
+		destination.push_back(frameCenter + rotated + jitter * (level.perspective * code.cols));
+	}
+
+	warpPerspective(code, corpusImage.image, getPerspectiveTransform(source, destination), corpusFrameSize, INTER_LINEAR, BORDER_CONSTANT, Scalar(255, 255, 255));
+
+	if (level.blur > 0.0)
+	{
+		GaussianBlur(corpusImage.image, corpusImage.image, Size(), level.blur);
+	}
+	if (level.noise > 0.0)
+	{
+		Mat noise(corpusImage.image.size(), CV_16SC3);
+		rng.fill(noise, RNG::NORMAL, 0.0, level.noise);
+		Mat noisy;
+		corpusImage.image.convertTo(noisy, CV_16SC3);
+		noisy += noise;
+		noisy.convertTo(corpusImage.image, CV_8UC3);
+	}
+	if (level.jpegQuality > 0)
+	{
+		vector<uchar> buffer;
+		imencode(".jpg", corpusImage.image, buffer, {IMWRITE_JPEG_QUALITY, level.jpegQuality});
+		corpusImage.image = imdecode(buffer, IMREAD_COLOR);
+	}
+	return corpusImage;
+}
+
+/// @brief Generate the images of one level. The seed depends only on the level and the index, so the corpus is the same on
+/// every run.
+/// @param levelIndex index in distortionLevels
+/// @param count number of images
+/// @return images
+vector<CorpusImage> generateCorpus(int levelIndex, int count)
+{
+	vector<CorpusImage> corpus;
+	for (int i = 0; i < count; i++)
+	{
+		RNG rng(static_cast<uint64>(levelIndex) * 100003 + i + 1);
+		string payload = generateRandomText(rng);
+		corpus.push_back(generateCorpusImage(payload, distortionLevels[levelIndex], rng));
+	}
+	return corpus;
+}
+
+/// @brief Write a corpus level to a directory, with one corpus.jsonl line per image holding the expected payload
+/// @param corpus images
+/// @param levelIndex index in distortionLevels
+/// @param directory output directory
+/// @param manifest corpus.jsonl
+void writeCorpus(const vector<CorpusImage> &corpus, int levelIndex, const string &directory, ofstream &manifest)
+{
+	for (size_t i = 0; i < corpus.size(); i++)
+	{
+		// JPEG levels are written at quality 100, so the file stays close to the image benchmarked here; the others lossless
+		string extension = distortionLevels[levelIndex].jpegQuality > 0 ? ".jpg" : ".png";
+		string fileName = "level" + to_string(levelIndex) + "_" + to_string(i) + extension;
+		vector<int> parameters;
+		if (distortionLevels[levelIndex].jpegQuality > 0)
+		{
+			parameters = {IMWRITE_JPEG_QUALITY, 100};
+		}
+		imwrite(directory + "/" + fileName, corpus[i].image, parameters);
+		manifest << "{\"file\":\"" << fileName << "\",\"level\":" << levelIndex << ",\"payload\":\"" << corpus[i].payload << "\"}\n";
+	}
+}
+
+/// @brief Decode every image with one decode path
+/// @param corpus images
+/// @param decode decode path, returns the decoded string or throws
+/// @return VariantResult
+VariantResult measureVariant(const vector<CorpusImage> &corpus, const function<string(const Mat &)> &decode)
+{
+	VariantResult result;
+	result.images = static_cast<int>(corpus.size());
+	double matchingCharacters = 0.0;
+
+	auto startTime = high_resolution_clock::now();
+	for (const CorpusImage &corpusImage : corpus)
+	{
+		string decoded;
+		try
+		{
+			decoded = decode(corpusImage.image);
+		}
+		catch (const std::exception &)
+		{
+			// A failed detection or alignment is a failed decode
+		}
+
+		result.decoded += decoded == corpusImage.payload ? 1 : 0;
+		for (size_t i = 0; i < min(decoded.size(), corpusImage.payload.size()); i++)
+		{
+			matchingCharacters += decoded[i] == corpusImage.payload[i] ? 1.0 : 0.0;
+		}
+	}
+	double seconds = duration_cast<microseconds>(high_resolution_clock::now() - startTime).count() / 1e6;
+
+	result.characterAccuracy = corpus.empty() ? 0.0 : 100.0 * matchingCharacters / (corpus.size() * maxDecodeLength);
+	result.imagesPerSecond = seconds > 0.0 ? corpus.size() / seconds : 0.0;
+	return result;
+}
+
+/// @brief Struct to hold the cell voting result of one level.
+struct VotingResult
+{
+	int firstFrameDecoded = 0; // The first decoded frame is the payload, as camera mode without --vote returns it
+	int voted = 0;						 // The votes became confident within voteWindowFrames frames
+	int votedCorrect = 0;			 // ... and are the payload
+	int votedFrames = 0;			 // Frames up to the confident votes, summed over the voted codes
+	int codes = 0;
+};
+
+/// @brief Film each code for up to voteWindowFrames frames, every one distorted anew, and merge the cells with CellVotes
+/// until every cell leads by voteConfidence, as camera mode does with --vote
+/// @param levelIndex index in distortionLevels
+/// @param count number of codes
+/// @param voteConfidence lead every cell needs over its runner-up color
+/// @return VotingResult
+VotingResult measureVoting(int levelIndex, int count, double voteConfidence)
+{
+	VotingResult result;
+	result.codes = count;
+	for (int i = 0; i < count; i++)
+	{
+		// Seeds apart from generateCorpus()
+		RNG rng(static_cast<uint64>(levelIndex) * 100003 + 50000 + i);
+		string payload = generateRandomText(rng);
+		CellVotes votes;
+		bool firstFrame = true;
+		for (size_t frame = 1; frame <= voteWindowFrames; frame++)
+		{
+			CorpusImage corpusImage = generateCorpusImage(payload, distortionLevels[levelIndex], rng);
+			vector<double> margins;
+			vector<uint8_t> codes;
+			try
+			{
+				string decoded = decodeBarcode(alignBarcodeImage(corpusImage.image), &margins, &codes);
+				result.firstFrameDecoded += firstFrame && decoded == payload ? 1 : 0;
+				firstFrame = false;
+			}
+			catch (const std::exception &)
+			{
+				// Markers not found in this frame, camera mode waits for the next one
+				continue;
+			}
+
+			votes.add(codes, margins);
+			vector<double> leads;
+			vector<uint8_t> winners = votes.winningCodes(&leads);
+			if (all_of(leads.begin(), leads.end(), [voteConfidence](double lead)
+								 { return lead >= voteConfidence; }))
+			{
+				result.voted++;
+				result.votedCorrect += decodeCellCodes(winners) == payload ? 1 : 0;
+				result.votedFrames += static_cast<int>(frame);
+				break;
+			}
+		}
+	}
+	return result;
+}
+
+/// @brief Print the result of one decode path on one level
+/// @param levelIndex index in distortionLevels
+/// @param name decode path
+/// @param result VariantResult
+void printResult(int levelIndex, const string &name, const VariantResult &result)
+{
+	cout << right << setw(5) << levelIndex << "  " << left << setw(16) << name << right << fixed << setprecision(1)
+			 << setw(10) << (result.images > 0 ? 100.0 * result.decoded / result.images : 0.0) << setw(12) << result.characterAccuracy
+			 << setw(10) << result.imagesPerSecond << endl;
+}
+
+int main(int argc, char **argv)
+{
+	int count = 20;
+	string corpusDirectory;
+	for (int i = 1; i < argc; i++)
+	{
+		string argument = argv[i];
+		if (argument == "--corpus" && i + 1 < argc)
+		{
+			corpusDirectory = argv[++i];
+		}
+		else
+		{
+			count = atoi(argv[i]);
+		}
+	}
+
+	try
+	{
+		if (count < 1)
+		{
+			cerr << "!! The image count must be at least 1." << endl;
+			return 1;
+		}
+
+		// Single thread throughput, comparable between machines
+		setNumThreads(1);
+
+		ofstream manifest;
+		if (!corpusDirectory.empty())
+		{
+			filesystem::create_directories(corpusDirectory);
+			manifest.open(corpusDirectory + "/corpus.jsonl");
+		}
+
+		// Decode paths, each with the options of the tool passed to the calls
+		auto decodeWarp = [](const Mat &image)
+		{ return decodeBarcode(alignBarcodeImage(image)); };
+		auto decodeDirect = [](const Mat &image)
+		{ return decodeBarcode(image, getAlignmentTransform(detectBlueCircles(image))); };
+		vector<pair<string, function<string(const Mat &)>>> variants = {
+				{"warp", decodeWarp},
+				{"direct", decodeDirect},
+				{"direct sample", [](const Mat &image)
+				 { return decodeBarcode(image, getAlignmentTransform(detectBlueCircles(image)), nullptr, nullptr, false, 0.5); }},
+				{"pyramid direct", [](const Mat &image)
+				 { return decodeBarcode(image, getAlignmentTransform(detectBlueCircles(image, true))); }}};
+
+		cout << count << " images per level, " << corpusFrameSize.width << "x" << corpusFrameSize.height << " frames" << endl;
+		cout << right << setw(5) << "Level" << "  " << left << setw(16) << "Variant" << right << setw(10) << "Success %" << setw(12)
+				 << "Chars %" << setw(10) << "Images/s" << endl;
+
+		int failures = 0;
+		for (int levelIndex = 0; levelIndex < static_cast<int>(distortionLevels.size()); levelIndex++)
+		{
+			vector<CorpusImage> corpus = generateCorpus(levelIndex, count);
+			if (manifest.is_open())
+			{
+				writeCorpus(corpus, levelIndex, corpusDirectory, manifest);
+			}
+
+			for (const auto &variant : variants)
+			{
+				VariantResult result = measureVariant(corpus, variant.second);
+				printResult(levelIndex, variant.first, result);
+
+				// Undistorted codes have to decode on every path; the distorted levels are reported
+				if (levelIndex == 0 && result.decoded != result.images)
+				{
+					failures++;
+				}
+			}
+		}
+
+		// Cell voting over consecutive frames against accepting the first decoded frame
+		const double voteConfidence = 0.5;
+		cout << endl
+				 << "Cell voting, confidence " << voteConfidence << ", up to " << voteWindowFrames << " frames per code" << endl;
+		cout << right << setw(5) << "Level" << setw(14) << "First frame %" << setw(10) << "Voted %" << setw(12) << "Correct %"
+				 << setw(10) << "Frames" << endl;
+		for (int levelIndex = 0; levelIndex < static_cast<int>(distortionLevels.size()); levelIndex++)
+		{
+			VotingResult result = measureVoting(levelIndex, count, voteConfidence);
+			cout << right << setw(5) << levelIndex << fixed << setprecision(1) << setw(14) << 100.0 * result.firstFrameDecoded / result.codes
+					 << setw(10) << 100.0 * result.voted / result.codes << setw(12) << (result.voted > 0 ? 100.0 * result.votedCorrect / result.voted : 0.0)
+					 << setw(10) << (result.voted > 0 ? static_cast<double>(result.votedFrames) / result.voted : 0.0) << endl;
+
+			// An undistorted code is confident and exact in its first frame
+			if (levelIndex == 0 && (result.votedCorrect != result.codes || result.votedFrames != result.codes))
+			{
+				failures++;
+			}
+		}
+
+		cout << endl
+				 << (failures == 0 ? "Every path and the cell voting decode the undistorted codes." : to_string(failures) + " paths failed on undistorted codes.") << endl;
+		return failures == 0 ? 0 : 1;
+	}
+	catch (const cv::Exception &e)
+	{
+		cerr << "OpenCV Exception: " << e.what() << std::endl;
+		return 1;
+	}
+	catch (const std::exception &e)
+	{
+		cerr << "Standard Exception: " << e.what() << std::endl;
+		return 1;
+	}
+}
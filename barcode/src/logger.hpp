@@ -0,0 +1,274 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+// Asynchronous levelled logger for the barcode decoder.
+// Producers copy their message into a lock-free ring buffer and return; a background thread writes them to the file.
+
+using namespace std;
+using namespace chrono;
+
+/// Highest log level compiled in: 0 error, 1 warning, 2 info, 3 debug.
+/// Messages above it are removed by the preprocessor, including the formatting of their arguments.
+/// e.g. -DBARCODE_LOG_LEVEL=1 compiles the per-cell debug logging out of decodeBarcode().
+#ifndef BARCODE_LOG_LEVEL
+#define BARCODE_LOG_LEVEL 3
+#endif
+
+enum class LogLevel
+{
+	Error = 0,
+	Warning = 1,
+	Info = 2,
+	Debug = 3
+};
+
+/// @brief Name of a log level
+/// @param level LogLevel
+/// @return name as written in the log
+inline const char *logLevelName(LogLevel level)
+{
+	switch (level)
+	{
+	case LogLevel::Error:
+		return "Error";
+	case LogLevel::Warning:
+		return "Warning";
+	case LogLevel::Info:
+		return "Info";
+	default:
+		return "Debug";
+	}
+}
+
+/// @brief Logger with a bounded multi-producer, single-consumer ring buffer and a writer thread.
+/// @details Each slot has a sequence number: a producer claims a slot with a compare-and-swap on the write position and
+/// publishes it by advancing the sequence, so producers never take a lock or wait on the disk.
+/// When the buffer is full the message is dropped and counted instead of blocking the decoder.
+/// The writer flushes once the buffer is drained, not per line.
+/// Producers are counted while they use the ring, so close() and open() only touch it once none is left.
+struct AsyncLogger
+{
+	static constexpr size_t capacity = 4096; // Power of two
+	static constexpr size_t messageLength = 512;
+
+	~AsyncLogger()
+	{
+		close();
+	}
+
+	/// @brief Open the log file and start the writer thread.
+	/// @param path log file
+	/// @param maximumLevel messages above this level are ignored at run time
+	void open(const string &path, LogLevel maximumLevel)
+	{
+		close();
+		file.open(path);
+		if (!file)
+		{
+			throw invalid_argument("Could not open the log file: " + path);
+		}
+
+		for (size_t i = 0; i < capacity; i++)
+		{
+			slots[i].sequence.store(i, memory_order_relaxed);
+		}
+		writePosition.store(0, memory_order_relaxed);
+		readPosition = 0;
+		droppedMessages.store(0, memory_order_relaxed);
+		running.store(true, memory_order_release);
+		writer = thread([this]()
+										{ writeMessages(); });
+		level.store(static_cast<int>(maximumLevel), memory_order_release);
+	}
+
+	/// @brief Stop the writer thread after it has written every queued message, then close the file.
+	void close()
+	{
+		level.store(-1, memory_order_release);
+		running.store(false, memory_order_seq_cst);
+
+		// A producer that got past the running check finishes its slot; later ones see running false and return
+		while (activeProducers.load(memory_order_seq_cst) > 0)
+		{
+			this_thread::yield();
+		}
+		if (writer.joinable())
+		{
+			writer.join();
+		}
+		if (file.is_open())
+		{
+			size_t dropped = droppedMessages.load(memory_order_relaxed);
+			if (dropped > 0)
+			{
+				file << "[Logger] [Warning]: Dropped " << dropped << " messages, the log buffer was full\n";
+			}
+			file.close();
+		}
+	}
+
+	/// @brief Whether messages of this level are written. Checked before a message is formatted.
+	bool enabled(LogLevel messageLevel) const
+	{
+		return static_cast<int>(messageLevel) <= level.load(memory_order_relaxed);
+	}
+
+	/// @brief Queue a message without blocking. Messages longer than messageLength are truncated.
+	/// Messages logged while the logger is closed are ignored.
+	void log(LogLevel messageLevel, const string &message)
+	{
+		activeProducers.fetch_add(1, memory_order_seq_cst);
+		if (!running.load(memory_order_seq_cst))
+		{
+			activeProducers.fetch_sub(1, memory_order_release);
+			return;
+		}
+
+		size_t position = writePosition.load(memory_order_relaxed);
+		Slot *slot;
+		while (true)
+		{
+			slot = &slots[position & (capacity - 1)];
+			size_t sequence = slot->sequence.load(memory_order_acquire);
+			if (sequence == position)
+			{
+				if (writePosition.compare_exchange_weak(position, position + 1, memory_order_relaxed))
+				{
+					break;
+				}
+			}
+			else if (sequence < position)
+			{
+				// Full: the writer has not freed this slot yet
+				droppedMessages.fetch_add(1, memory_order_relaxed);
+				activeProducers.fetch_sub(1, memory_order_release);
+				return;
+			}
+			else
+			{
+				position = writePosition.load(memory_order_relaxed);
+			}
+		}
+
+		slot->level = messageLevel;
+		slot->length = min(message.size(), messageLength);
+		memcpy(slot->text, message.data(), slot->length);
+		slot->sequence.store(position + 1, memory_order_release);
+		activeProducers.fetch_sub(1, memory_order_release);
+	}
+
+private:
+	struct Slot
+	{
+		atomic<size_t> sequence{0};
+		LogLevel level = LogLevel::Debug;
+		size_t length = 0;
+		char text[messageLength];
+	};
+
+	/// @brief Writer thread: write the published slots in order and hand them back to the producers.
+	/// After close() it keeps going until every claimed slot is published and written.
+	void writeMessages()
+	{
+		while (true)
+		{
+			bool wrote = false;
+			while (true)
+			{
+				Slot &slot = slots[readPosition & (capacity - 1)];
+				if (slot.sequence.load(memory_order_acquire) != readPosition + 1)
+				{
+					break;
+				}
+				file << '[' << logLevelName(slot.level) << "] ";
+				file.write(slot.text, slot.length);
+				file << '\n';
+				slot.sequence.store(readPosition + capacity, memory_order_release);
+				readPosition++;
+				wrote = true;
+			}
+
+			if (wrote)
+			{
+				file.flush();
+			}
+			else if (!running.load(memory_order_acquire) && readPosition == writePosition.load(memory_order_acquire))
+			{
+				return;
+			}
+			else
+			{
+				this_thread::sleep_for(milliseconds(1));
+			}
+		}
+	}
+
+	array<Slot, capacity> slots;
+	atomic<size_t> writePosition{0};
+	size_t readPosition = 0;
+	atomic<size_t> droppedMessages{0};
+	atomic<int> activeProducers{0};
+	atomic<int> level{-1};
+	atomic<bool> running{false};
+	ofstream file;
+	thread writer;
+};
+
+/// @brief The logger of the process. Disabled until open() is called.
+inline AsyncLogger &logger()
+{
+	static AsyncLogger instance;
+	return instance;
+}
+
+// Log a streamed message, e.g. LOG_DEBUG("[decodeBarcode]: bits: " << bits).
+// The message is only formatted when its level is enabled at run time.
+#define BARCODE_LOG(messageLevel, message)                  \
+	do                                                        \
+	{                                                         \
+		if (logger().enabled(messageLevel))                     \
+		{                                                       \
+			ostringstream logStream;                              \
+			logStream << message;                                 \
+			logger().log(messageLevel, logStream.str());          \
+		}                                                       \
+	} while (0)
+
+#define LOG_ERROR(message) BARCODE_LOG(LogLevel::Error, message)
+
+#if BARCODE_LOG_LEVEL >= 1
+#define LOG_WARNING(message) BARCODE_LOG(LogLevel::Warning, message)
+#else
+#define LOG_WARNING(message) \
+	do                         \
+	{                          \
+	} while (0)
+#endif
+
+#if BARCODE_LOG_LEVEL >= 2
+#define LOG_INFO(message) BARCODE_LOG(LogLevel::Info, message)
+#else
+#define LOG_INFO(message) \
+	do                      \
+	{                       \
+	} while (0)
+#endif
+
+#if BARCODE_LOG_LEVEL >= 3
+#define LOG_DEBUG(message) BARCODE_LOG(LogLevel::Debug, message)
+#else
+#define LOG_DEBUG(message) \
+	do                       \
+	{                        \
+	} while (0)
+#endif
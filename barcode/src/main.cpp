@@ -1,420 +1,629 @@
 #include <iostream>
 #include <opencv2/opencv.hpp>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <iomanip>
+#include <mutex>
+#include <numeric>
+#include <sstream>
+#include <thread>
 #include <unordered_set>
 
 // Debug
 #include <iostream>
 #include <fstream>
+#include "barcode.hpp"
 
 using namespace cv;
 using namespace std;
+using namespace chrono;
 
-int gridSize = 47;
-size_t maxDecodeLength = 1050;
-ofstream logFile("log.txt");
+// Set by --multi: decode every barcode in view instead of exactly one
+bool multiBarcode = false;
 
-// Color map for 8 colors to avoid magic strings
-struct ColorMap
+/// @brief Struct to hold the decoded payload, status and stage timings of one image in batch mode.
+struct BatchResult
 {
-	const Vec3b black = {0, 0, 0};
-	const Vec3b blue = {255, 0, 0};
-	const Vec3b green = {0, 255, 0};
-	const Vec3b red = {0, 0, 255};
-	const Vec3b cyan = {255, 255, 0};
-	const Vec3b magenta = {255, 0, 255};
-	const Vec3b yellow = {0, 255, 255};
-	const Vec3b white = {255, 255, 255};
+	string fileName;
+	string status = "ok";
+	string payload;
+	vector<string> payloads; // Every decoded barcode with --multi
+	string error;
+	double minMargin = 0.0;
+	double meanMargin = 0.0;
+	double detectMilliseconds = 0.0;
+	double alignMilliseconds = 0.0;
+	double decodeMilliseconds = 0.0;
+	double totalMilliseconds = 0.0;
 };
-ColorMap colorMap;
-struct Vec3bComparator
+
+/// @brief Milliseconds since a start time
+/// @param startTime start time
+/// @return elapsed milliseconds
+double millisecondsSince(high_resolution_clock::time_point startTime)
+{
+	return duration_cast<microseconds>(high_resolution_clock::now() - startTime).count() / 1000.0;
+}
+
+/// @brief Escape a string for a JSON value
+/// @param text text
+/// @return escaped text, without quotes
+string jsonEscape(const string &text)
 {
-	bool operator()(const Vec3b &a, const Vec3b &b) const
+	ostringstream escaped;
+	for (unsigned char character : text)
 	{
-		if (a[0] != b[0])
+		if (character == '"' || character == '\\')
 		{
-			return a[0] < b[0];
+			escaped << '\\' << character;
 		}
-		if (a[1] != b[1])
+		else if (character < 0x20)
 		{
-			return a[1] < b[1];
+			escaped << "\\u" << hex << setw(4) << setfill('0') << static_cast<int>(character) << dec;
+		}
+		else
+		{
+			escaped << character;
 		}
-
-		return a[2] < b[2];
 	}
-};
+	return escaped.str();
+}
 
-/// @brief Get color name
-/// @param color Color bgr
-/// @return color as string
-string getColorName(const Vec3b &color)
+/// @brief One JSON line of a batch result
+/// @param result BatchResult
+/// @return JSON object without a newline
+string toJsonLine(const BatchResult &result)
 {
-	if (color == colorMap.black)
-	{
-		return "black";
-	}
-	if (color == colorMap.blue)
+	ostringstream line;
+	line << "{\"file\":\"" << jsonEscape(result.fileName) << "\",\"status\":\"" << result.status << "\",\"payload\":\"" << jsonEscape(result.payload) << "\"";
+	if (!result.error.empty())
 	{
-		return "blue";
+		line << ",\"error\":\"" << jsonEscape(result.error) << "\"";
 	}
-	if (color == colorMap.green)
-	{
-		return "green";
-	}
-	if (color == colorMap.cyan)
-	{
-		return "cyan";
-	}
-	if (color == colorMap.red)
-	{
-		return "red";
-	}
-	if (color == colorMap.magenta)
-	{
-		return "magenta";
-	}
-	if (color == colorMap.yellow)
-	{
-		return "yellow";
-	}
-	if (color == colorMap.white)
-	{
-		return "white";
-	}
-	return "unknown";
-}
-// Encdoing Array table. First chracter is space.
-char encodingArray[64] = {
-		' ', 'a', 'b', 'c', 'd', 'e', 'f', 'g',
-		'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o',
-		'p', 'q', 'r', 's', 't', 'u', 'v', 'x',
-		'y', 'w', 'z', 'A', 'B', 'C', 'D', 'E',
-		'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M',
-		'N', 'O', 'P', 'Q', 'R', 'S', 'T', 'U',
-		'V', 'X', 'Y', 'W', 'Z',
-		'0', '1', '2', '3', '4', '5', '6', '7',
-		'8', '9', '.'};
-
-map<Vec3b, string, Vec3bComparator> eightColorMap = {
-		{colorMap.black, "000"},
-		{colorMap.blue, "001"},
-		{colorMap.green, "010"},
-		{colorMap.cyan, "011"},
-		{colorMap.red, "100"},
-		{colorMap.magenta, "101"},
-		{colorMap.yellow, "110"},
-		{colorMap.white, "111"}};
-
-/// @brief The marker zone is the 6x6 square in the top-left, bottom-left, and bottom-right corners of the barcode.
-/// @param row Grid row
-/// @param col Grid column
-/// @return return true if the square is in the marker zone, otherwise false
-bool isInMarkerZone(int row, int col)
-{
-	// 6x6 markers excluded in 47x47 grid
-	return (row < 6 && col < 6) ||	 // top-left marker
-				 (row >= 41 && col < 6) || // bottom-left marker
-				 (row >= 41 && col >= 41); // bottom-right marker
-}
-
-/// @brief The decoding is composed of 8 colors code, we need to find the closest color
-/// @param pixel  The pixel color to find the closest color for
-/// @return The closest color in the colorMap
-Vec3b findClosestColor(Vec3b pixel)
-{
-	Vec3b closestColor = {0, 0, 0};
-	int minDist = INT_MAX;
-
-	for (const auto &color : eightColorMap)
+	if (multiBarcode)
 	{
-		Vec3i pixelInt = Vec3i(pixel);
-		Vec3i colorInt = Vec3i(color.first);
-
-		// Euclidean distance to find the distance betwen pixels
-		int dist = norm(pixelInt - colorInt);
-
-		if (dist < minDist)
+		line << ",\"payloads\":[";
+		for (size_t i = 0; i < result.payloads.size(); i++)
 		{
-			minDist = dist;
-			closestColor = colorInt;
+			line << (i > 0 ? "," : "") << "\"" << jsonEscape(result.payloads[i]) << "\"";
 		}
+		line << "]";
 	}
-	return closestColor;
+	line << ",\"min_margin\":" << result.minMargin << ",\"mean_margin\":" << result.meanMargin;
+	line << ",\"timings_ms\":{\"detectBlueCircles\":" << result.detectMilliseconds << ",\"alignBarcodeImage\":" << result.alignMilliseconds
+			 << ",\"decodeBarcode\":" << result.decodeMilliseconds << ",\"total\":" << result.totalMilliseconds << "}}";
+	return line.str();
 }
 
-/// @brief Detect the area of the barcode in the image. This is necessary as the square is bordered with a black border
-/// @param image The input image to detect the barcode area
-/// @return The bounding rectangle of the detected barcode area
-Rect detectBarcodeArea(const Mat &image)
+/// @brief Read and decode one image of a batch, timing each stage
+/// @details Failures are reported in the status instead of exceptions, so one bad image does not stop the batch.
+/// status: ok, read_failed, circles_not_found, align_failed, decode_failed or empty
+/// @param inputPath image path
+/// @param sampleWindowFraction fraction of the cell width and height averaged around each cell center, see decodeBarcode()
+/// @param pyramidDetection detect the markers on an image pyramid, for markers of any size
+/// @return BatchResult
+BatchResult decodeBatchImage(const string &inputPath, double sampleWindowFraction, bool pyramidDetection)
 {
-	Mat gray, thresh;
-	cvtColor(image, gray, COLOR_BGR2GRAY);
-	threshold(gray, thresh, 220, 255, THRESH_BINARY_INV);
-
-	// Find the whole part
-	Mat kernel = getStructuringElement(MORPH_RECT, Size(3, 3));
-	morphologyEx(thresh, thresh, MORPH_CLOSE, kernel);
+	BatchResult result;
+	result.fileName = inputPath;
+	auto startTime = high_resolution_clock::now();
 
-	vector<Point> points;
-	// Find all white pixels
-	findNonZero(thresh, points);
-
-	if (points.empty())
+	try
 	{
-		return Rect();
-	}
-
-	return boundingRect(points);
-}
+		Mat image = imread(inputPath, IMREAD_COLOR);
+		if (image.empty())
+		{
+			result.status = "read_failed";
+			result.totalMilliseconds = millisecondsSince(startTime);
+			return result;
+		}
 
-/// @brief Decode the barcode from the provided image.
-/// @param image Image
-/// @return Decoded string
-string decodeBarcode(const Mat &image)
-{
-	string decoded;
+		auto stageStart = high_resolution_clock::now();
+		vector<Point2f> circles = multiBarcode ? detectAllBlueCircles(image, pyramidDetection) : detectBlueCircles(image, pyramidDetection);
+		result.detectMilliseconds = millisecondsSince(stageStart);
 
-	// Check the offset of the image. Because the image is filled with black border, we need to exclude rough border width
-	Rect roughBorderRectangle = detectBarcodeArea(image);
-	double squareWidth = roughBorderRectangle.width / static_cast<double>(gridSize);
-	double squareHeight = roughBorderRectangle.height / static_cast<double>(gridSize);
-	double offsetX = roughBorderRectangle.x;
-	double offsetY = roughBorderRectangle.y;
-
-	vector<string> bitsList;
-
-	// Debug
-	logFile << "[decodeBarcode] [Debug]: Image size: " << image.cols << "x" << image.rows << endl;
-	logFile << "[decodeBarcode] [Debug]: Border Rectangle: x=" << roughBorderRectangle.x << ", y=" << roughBorderRectangle.y << ", w=" << roughBorderRectangle.width << ", h=" << roughBorderRectangle.height << endl;
-	logFile << "[decodeBarcode] [Debug]: Square size: " << squareWidth << "x" << squareHeight << endl;
-	logFile << "[decodeBarcode] [Debug]: Offset: " << offsetX << ", " << offsetY << endl;
-	logFile << endl;
-	// Debug
-	Mat debugImg = image.clone();
-
-	for (int row = 0; row < gridSize; row++)
-	{
-		for (int col = 0; col < gridSize; col++)
+		// Every barcode in view: grouping and alignment are part of the decode stage
+		if (multiBarcode)
 		{
-			// 6x6 markers excluded in 47x47 grid; one top-left, one bottom-left, and one bottom-right
-			if (isInMarkerZone(row, col))
+			if (circles.size() < 3)
 			{
-				continue;
+				result.status = "circles_not_found";
+				result.error = "Found " + to_string(circles.size()) + " circles, expected at least 3";
+				result.totalMilliseconds = millisecondsSince(startTime);
+				return result;
 			}
 
-			double x0 = offsetX + col * squareWidth;
-			double x1 = offsetX + (col + 1) * squareWidth;
-			double y0 = offsetY + row * squareHeight;
-			double y1 = offsetY + (row + 1) * squareHeight;
-
-			// We are picking up the pixel in the middle of the square box
-			Point center(round((x0 + x1) / 2.0), round((y0 + y1) / 2.0));
+			stageStart = high_resolution_clock::now();
+			vector<DecodedBarcode> barcodes = decodeBarcodes(image, circles, false, sampleWindowFraction);
+			result.decodeMilliseconds = millisecondsSince(stageStart);
 
-			// Debug
-			// Add a small dot to the image so that we can see center of the square is calculated right
-			// Which can be seen in debug image debug_centers.jpg under 'build' folder
-			circle(debugImg, center, 5, Scalar(0, 0, 255), FILLED);
+			for (const DecodedBarcode &barcode : barcodes)
+			{
+				if (!barcode.payload.empty())
+				{
+					result.payloads.push_back(barcode.payload);
+				}
+			}
 
-			Vec3b pixel = image.at<Vec3b>(center);
+			// Without any payload the first barcode gives the status, as in the single barcode path
+			if (!result.payloads.empty())
+			{
+				result.payload = result.payloads[0];
+			}
+			else if (barcodes.empty())
+			{
+				result.status = "align_failed";
+				result.error = "No " + to_string(circles.size()) + " circles form the markers of a barcode";
+			}
+			else
+			{
+				const DecodedBarcode &failed = barcodes.front();
+				result.status = failed.error.empty() ? "empty" : (failed.aligned ? "decode_failed" : "align_failed");
+				result.error = failed.error;
+			}
+			result.totalMilliseconds = millisecondsSince(startTime);
+			return result;
+		}
 
-			// Quantize the pixel color to the closest color in the 8 color map
-			Vec3b quantized = findClosestColor(pixel);
+		if (circles.size() != 3)
+		{
+			result.status = "circles_not_found";
+			result.error = "Found " + to_string(circles.size()) + " circles, expected 3";
+			result.totalMilliseconds = millisecondsSince(startTime);
+			return result;
+		}
 
-			// Convert the appropriate color to a string of bits
-			string bits = eightColorMap[quantized];
+		stageStart = high_resolution_clock::now();
+		// With --direct the alignment stage only computes the transform
+		Mat aligned, affine;
+		try
+		{
+			if (directSampling)
+			{
+				affine = getAlignmentTransform(circles);
+			}
+			else
+			{
+				aligned = alignBarcodeImage(image, circles);
+			}
+		}
+		catch (const std::exception &e)
+		{
+			result.status = "align_failed";
+			result.error = e.what();
+		}
+		result.alignMilliseconds = millisecondsSince(stageStart);
 
-			// Debug
-			logFile << "[decodeBarcode] [DEBUG]: color: " << getColorName(quantized) << endl;
-			logFile << "[decodeBarcode] [DEBUG]: square (" << col << "," << row << ") center: " << center << endl;
-			logFile << "[decodeBarcode] [DEBUG]: pixel (BGR): ("
-							<< (int)pixel[0] << ","
-							<< (int)pixel[1] << ","
-							<< (int)pixel[2] << ")" << endl;
-			logFile << "[decodeBarcode] [DEBUG]: bits: " << bits << endl;
-			logFile << endl;
+		if (!aligned.empty() || !affine.empty())
+		{
+			stageStart = high_resolution_clock::now();
+			vector<double> margins;
+			result.payload = directSampling ? decodeBarcode(image, affine, &margins, nullptr, false, sampleWindowFraction)
+																			: decodeBarcode(aligned, &margins, nullptr, false, sampleWindowFraction);
+			result.decodeMilliseconds = millisecondsSince(stageStart);
+			if (!margins.empty())
+			{
+				result.minMargin = *min_element(margins.begin(), margins.end());
+				result.meanMargin = accumulate(margins.begin(), margins.end(), 0.0) / margins.size();
+			}
 
-			bitsList.push_back(bits);
+			if (result.payload.empty())
+			{
+				result.status = "empty";
+			}
 		}
 	}
-
-	// Debug big list
-	logFile << "[decodeBarcode] [DEBUG]: Bits list: " << endl;
-	for (const auto &bits : bitsList)
+	catch (const std::exception &e)
 	{
-		logFile << bits << " ";
+		result.status = "decode_failed";
+		result.error = e.what();
 	}
-	logFile << endl;
 
-	// Combine the bits into a single string
-	for (size_t i = 0; i + 1 < bitsList.size(); i += 2)
+	result.totalMilliseconds = millisecondsSince(startTime);
+	return result;
+}
+
+/// @brief Get the images of a batch directory
+/// @param directory input directory
+/// @return sorted image paths
+vector<string> getBatchImagePaths(const string &directory)
+{
+	if (!filesystem::is_directory(directory))
 	{
-		// Bit is composed of two colors
-		string bits = bitsList[i] + bitsList[i + 1];
-		int index = bitset<6>(bits).to_ulong();
+		throw invalid_argument("Batch input is not a directory: " + directory);
+	}
 
-		// Double check the index
-		if (index < 64)
+	vector<string> paths;
+	for (const auto &entry : filesystem::directory_iterator(directory))
+	{
+		if (entry.is_regular_file() && haveImageReader(entry.path().string()))
 		{
-			decoded += encodingArray[index];
+			paths.push_back(entry.path().string());
 		}
 	}
+	sort(paths.begin(), paths.end());
+	return paths;
+}
 
-	logFile << "[decodeBarcode] [DEBUG]: Decoded string: " << endl;
-	logFile << decoded << endl;
-	logFile << endl;
-	cout << decoded << endl;
-
-	// Debug to check the if the centers are calculated right
-	imwrite("debug_centers.jpg", debugImg);
+/// @brief Decode every image of a directory on threadCount threads and write one JSON line per image.
+/// @details Each thread takes the next image index from an atomic counter. The lines are written in completion order,
+/// each with its file name. OpenCV's own threads are turned off, as every core already decodes its own image.
+/// A summary is printed to cerr.
+/// @param directory input directory
+/// @param output JSONL output
+/// @param threadCount number of threads
+/// @param sampleWindowFraction fraction of the cell width and height averaged around each cell center, see decodeBarcode()
+/// @param pyramidDetection detect the markers on an image pyramid, for markers of any size
+/// @return number of images that could not be decoded
+int decodeBatch(const string &directory, ostream &output, int threadCount, double sampleWindowFraction, bool pyramidDetection)
+{
+	vector<string> paths = getBatchImagePaths(directory);
+	setNumThreads(1);
+
+	atomic<size_t> nextImage(0);
+	mutex outputMutex;
+	int failures = 0;
+	double detectMilliseconds = 0.0;
+	double alignMilliseconds = 0.0;
+	double decodeMilliseconds = 0.0;
+	auto startTime = high_resolution_clock::now();
+
+	vector<thread> workers;
+	for (int i = 0; i < threadCount; i++)
+	{
+		workers.emplace_back([&]()
+												 {
+													 for (size_t index = nextImage++; index < paths.size(); index = nextImage++)
+													 {
+														 BatchResult result = decodeBatchImage(paths[index], sampleWindowFraction, pyramidDetection);
+														 string line = toJsonLine(result);
+
+														 lock_guard<mutex> lock(outputMutex);
+														 output << line << '\n';
+														 failures += result.status == "ok" ? 0 : 1;
+														 detectMilliseconds += result.detectMilliseconds;
+														 alignMilliseconds += result.alignMilliseconds;
+														 decodeMilliseconds += result.decodeMilliseconds;
+													 }
+												 });
+	}
 
-	// Ensure exactly 1050 characters
-	if (decoded.length() > maxDecodeLength)
+	for (thread &worker : workers)
 	{
-		logFile << "[Decode] Trimming to 1050 characters" << endl;
-		decoded = decoded.substr(0, maxDecodeLength);
+		worker.join();
 	}
-
-	return decoded;
+	output.flush();
+
+	double seconds = millisecondsSince(startTime) / 1000.0;
+	double count = paths.empty() ? 1.0 : static_cast<double>(paths.size());
+	cerr << "[decodeBatch] Images: " << paths.size() << ". Failed: " << failures << ". Threads: " << threadCount
+			 << ". Images per second: " << paths.size() / seconds << endl;
+	cerr << "[decodeBatch] Mean milliseconds - detectBlueCircles: " << detectMilliseconds / count << ". alignBarcodeImage: " << alignMilliseconds / count
+			 << ". decodeBarcode: " << decodeMilliseconds / count << endl;
+	return failures;
 }
 
-/// @brief Check if the triangle is balanced
-/// @param ab Distance between A and B
-/// @param bc Distance between B and C
-/// @param ac Distance between A and C
-/// @return true if the triangle is balanced, otherwise false
-bool isTriangleDistanceBalanced(double ab, double bc, double ac)
+/// @brief Queue of the latest items: push never blocks, it drops the oldest item when the queue is full.
+/// Used between the camera stages, so a slow stage works on the newest frame instead of stalling the capture.
+template <typename T>
+struct LatestQueue
 {
-	double maxDist = max({ab, bc, ac});
-	double minDist = min({ab, bc, ac});
+	explicit LatestQueue(size_t capacity) : capacity(capacity) {}
 
-	return (maxDist / minDist < 2.5);
-}
+	/// @brief Add an item, dropping the oldest one if the queue is full.
+	void push(T item)
+	{
+		lock_guard<mutex> lock(queueMutex);
+		if (items.size() == capacity)
+		{
+			items.pop_front();
+			dropped++;
+		}
+		items.push_back(move(item));
+		notEmpty.notify_one();
+	}
 
-/// @brief Detect 3 blue circles (top-left, bottom-left, bottom-right)
-/// @param image Input image (BGR)
-/// @return vector of 3 circle centers if found
-vector<Point2f> detectBlueCircles(const Mat &image)
-{
-	Mat hsv;
-	cvtColor(image, hsv, COLOR_BGR2HSV);
-	Mat mask;
-	inRange(hsv, Scalar(90, 30, 30), Scalar(140, 255, 255), mask);
-	GaussianBlur(mask, mask, Size(9, 9), 2);
+	/// @brief Take the oldest item, waiting while the queue is empty.
+	/// @return false when the queue is closed and there are no items left
+	bool pop(T &item)
+	{
+		unique_lock<mutex> lock(queueMutex);
+		notEmpty.wait(lock, [this]()
+									{ return !items.empty() || closed; });
 
-	vector<Vec3f> circles;
-	HoughCircles(mask, circles, HOUGH_GRADIENT, 1, mask.rows / 5, 100, 35, 30, 50);
+		if (items.empty())
+		{
+			return false;
+		}
 
-	vector<Point2f> centers;
-	for (const auto &c : circles)
-	{
-		centers.emplace_back(c[0], c[1]);
+		item = move(items.front());
+		items.pop_front();
+		return true;
 	}
 
-	return centers;
-}
-
-/// @brief Align the image if the image is rotated
-/// @param image Input image
-/// @return return aligned image
-Mat alignBarcodeImage(const Mat &image)
-{
-	// Detect blue color for more accuracy
-	vector<Point2f> circles = detectBlueCircles(image);
-	if (circles.size() != 3)
+	/// @brief No more items will be pushed. Wakes the consumer once the queue is drained.
+	void close()
 	{
-		logFile << "[Align Image] [Error]: Found " << circles.size() << " circles, expected 3" << endl;
-		throw invalid_argument("[Align Image] [Error]: Could not find exactly three circles");
+		lock_guard<mutex> lock(queueMutex);
+		closed = true;
+		notEmpty.notify_all();
 	}
 
-	// Extract centers only; c[2] will be radius
-	vector<Point2f> centers;
-	for (const Point2f &c : circles)
+	/// @brief Number of items dropped because the consumer was behind
+	size_t droppedCount()
 	{
-		centers.push_back(c);
+		lock_guard<mutex> lock(queueMutex);
+		return dropped;
 	}
 
-	// Determine right-angle triangle (bottom-left marker should be the right angle)
-	Point2f A = centers[0], B = centers[1], C = centers[2];
-	Point2f rightAngle, topLeft, bottomRight;
-	double distanceBetweenAB = norm(A - B);
-	double distanceBetweenAC = norm(A - C);
-	double distanceBetweenBC = norm(B - C);
+private:
+	size_t capacity;
+	deque<T> items;
+	size_t dropped = 0;
+	bool closed = false;
+	mutex queueMutex;
+	condition_variable notEmpty;
+};
 
-	// This is for the dynamic detection of the image through camera
-	if (!isTriangleDistanceBalanced(distanceBetweenAB, distanceBetweenBC, distanceBetweenAC))
-	{
-		cerr << "[Align Image] [Error]: Circle distances too unbalanced to form proper barcode frame." << endl;
-		throw invalid_argument("Circle distances too unbalanced to form proper barcode frame.");
-	}
+/// @brief Struct to hold a camera frame on its way through the pipeline.
+struct CameraFrame
+{
+	Mat frame;
+	vector<Point2f> circles;
+	string decoded;
+	high_resolution_clock::time_point captureTime;
+};
 
-	// Find the right angle using Pythagorean Theorem a^2 + b^2 = c^2
-	auto isRightTriangle = [](double a2, double b2, double c2)
-	{
-		double sum = a2 + b2;
-		double diff = abs(sum - c2);
-		return diff <= c2 * 0.05;
-	};
+/// @brief Struct to hold the number of items and the busy time of a pipeline stage.
+struct StageStatistics
+{
+	size_t count = 0;
+	double busyMilliseconds = 0.0;
+};
 
-	if (isRightTriangle(distanceBetweenAB * distanceBetweenAB, distanceBetweenAC * distanceBetweenAC, distanceBetweenBC * distanceBetweenBC))
-	{
-		rightAngle = A;
-		topLeft = B;
-		bottomRight = C;
-	}
-	else if (isRightTriangle(distanceBetweenAB * distanceBetweenAB, distanceBetweenBC * distanceBetweenBC, distanceBetweenAC * distanceBetweenAC))
-	{
-		rightAngle = B;
-		topLeft = A;
-		bottomRight = C;
+/// @brief Print the frames per second and the utilisation of a stage
+/// @param name stage name
+/// @param statistics StageStatistics
+/// @param seconds run time
+void printStageStatistics(const string &name, const StageStatistics &statistics, double seconds)
+{
+	cerr << "[decodeCamera] " << name << ": " << statistics.count << " frames, " << statistics.count / seconds << " fps, busy "
+			 << 100.0 * statistics.busyMilliseconds / (seconds * 1000.0) << "%" << endl;
+}
+
+// Frames waiting between two camera stages. Small, so every stage works on a recent frame.
+const size_t cameraQueueCapacity = 2;
+
+// How long the decoded frame stays on screen, unless a key is pressed
+const int resultDisplayMilliseconds = 2000;
+
+/// @brief Decode a barcode from the camera with a capture, marker detection, decode and display stage, each on its own thread
+/// (display on the calling thread, as HighGUI requires).
+/// @details The stages are connected by LatestQueues that drop the oldest frame, so capture never waits for a slow HoughCircles
+/// and the decoder always works on a recent frame. Stops at the first decoded barcode or a key press. The decoded frame
+/// is shown last, for resultDisplayMilliseconds.
+/// Reports the throughput and utilisation of every stage, the dropped frames and the latency from the start of the
+/// camera read to the end of each decode.
+/// @param cap opened camera
+/// @param debug write the debug images of every debugImageInterval-th decode
+/// @param track track the markers between frames with trackBlueCircles() instead of searching every whole frame
+/// @param voteConfidence lead every cell needs over its runner-up color before the CellVotes of the frames are accepted.
+/// 0 accepts the first decoded frame.
+/// @param sampleWindowFraction fraction of the cell width and height averaged around each cell center, see decodeBarcode()
+/// @param pyramidDetection search whole frames on an image pyramid, for markers of any size
+/// @return decoded string, empty if stopped before a barcode was decoded
+string decodeCamera(VideoCapture &cap, bool debug, bool track, double voteConfidence, double sampleWindowFraction, bool pyramidDetection)
+{
+	LatestQueue<CameraFrame> detectQueue(cameraQueueCapacity);
+	LatestQueue<CameraFrame> decodeQueue(cameraQueueCapacity);
+	LatestQueue<CameraFrame> displayQueue(cameraQueueCapacity);
+	atomic<bool> stop(false);
+	StageStatistics captureStatistics, detectStatistics, decodeStatistics, displayStatistics;
+	vector<double> latencies;
+	double decodedLatency = 0.0;
+	string decoded;
+	// The decoded frame gets its own slot: in the displayQueue, later previews of the detect stage would evict it.
+	// Written by the decode stage before it closes the displayQueue.
+	Mat decodedFrame;
+	MarkerTracker tracker;
+	CellVotes votes;
+	int votedFrames = 0;
+	double confidentCells = 0.0;
+	auto startTime = high_resolution_clock::now();
+
+	thread capture([&]()
+								 {
+									 while (!stop)
+									 {
+										 CameraFrame item;
+										 // Stamped before the read, so the latency includes the time the read blocks
+										 auto stageStart = high_resolution_clock::now();
+										 item.captureTime = stageStart;
+										 cap >> item.frame;
+										 if (item.frame.empty())
+										 {
+											 break;
+										 }
+										 captureStatistics.count++;
+										 captureStatistics.busyMilliseconds += millisecondsSince(stageStart);
+										 detectQueue.push(move(item));
+									 }
+									 detectQueue.close(); });
+
+	thread detect([&]()
+								{
+									CameraFrame item;
+									while (detectQueue.pop(item))
+									{
+										auto stageStart = high_resolution_clock::now();
+										if (multiBarcode)
+										{
+											// The tracker follows a single barcode
+											item.circles = detectAllBlueCircles(item.frame, pyramidDetection);
+										}
+										else if (track)
+										{
+											item.circles = trackBlueCircles(item.frame, tracker, duration_cast<microseconds>(item.captureTime - startTime).count() / 1000.0, pyramidDetection);
+										}
+										else
+										{
+											item.circles = detectBlueCircles(item.frame, pyramidDetection);
+										}
+
+										// The decoder gets the clean frame, the display an annotated copy
+										CameraFrame preview;
+										preview.frame = item.frame.clone();
+										preview.captureTime = item.captureTime;
+										for (const Point2f &center : item.circles)
+										{
+											circle(preview.frame, center, 30, Scalar(0, 0, 255), 2);
+											circle(preview.frame, center, 4, Scalar(0, 255, 0), -1);
+										}
+										if (multiBarcode ? item.circles.size() < 3 : item.circles.size() != 3)
+										{
+											string msg = "Circles found: " + to_string(item.circles.size()) + " / 3";
+											putText(preview.frame, msg, Point(50, 50),
+															FONT_HERSHEY_SIMPLEX, 1, Scalar(0, 0, 255), 2);
+										}
+										else
+										{
+											decodeQueue.push(move(item));
+										}
+										detectStatistics.count++;
+										detectStatistics.busyMilliseconds += millisecondsSince(stageStart);
+										displayQueue.push(move(preview));
+									}
+									decodeQueue.close(); });
+
+	thread decode([&]()
+								{
+									CameraFrame item;
+									int attempt = 0;
+									while (decodeQueue.pop(item))
+									{
+										if (stop)
+										{
+											continue;
+										}
+										auto stageStart = high_resolution_clock::now();
+										// Debug images of every debugImageInterval-th decode only
+										bool writeDebugImages = debug && attempt++ % debugImageInterval == 0;
+										try
+										{
+											if (multiBarcode)
+											{
+												// Every barcode in view, one per line
+												for (const DecodedBarcode &barcode : decodeBarcodes(item.frame, item.circles, writeDebugImages, sampleWindowFraction))
+												{
+													if (!barcode.payload.empty())
+													{
+														item.decoded += (item.decoded.empty() ? "" : "\n") + barcode.payload;
+													}
+												}
+											}
+											else
+											{
+												vector<double> margins;
+												vector<uint8_t> codes;
+												if (directSampling)
+												{
+													item.decoded = decodeBarcode(item.frame, getAlignmentTransform(item.circles), &margins, &codes, writeDebugImages, sampleWindowFraction);
+												}
+												else
+												{
+													item.decoded = decodeBarcode(alignBarcodeImage(item.frame, item.circles, writeDebugImages), &margins, &codes, writeDebugImages, sampleWindowFraction);
+												}
+
+												// Merge the cells with the previous frames and only accept once every cell leads by voteConfidence
+												if (voteConfidence > 0.0)
+												{
+													votes.add(codes, margins);
+													votedFrames++;
+													vector<double> leads;
+													vector<uint8_t> winners = votes.winningCodes(&leads);
+													size_t confident = count_if(leads.begin(), leads.end(), [voteConfidence](double lead)
+																											{ return lead >= voteConfidence; });
+													confidentCells = leads.empty() ? 0.0 : 100.0 * confident / leads.size();
+													LOG_INFO("[decodeCamera]: " << votes.frames.size() << " voting frames, " << confidentCells << "% of the cells confident");
+													item.decoded = confident == leads.size() ? decodeCellCodes(winners) : "";
+												}
+											}
+										}
+										catch (const std::exception &e)
+										{
+											LOG_WARNING("[decodeCamera]: " << e.what());
+										}
+										decodeStatistics.count++;
+										decodeStatistics.busyMilliseconds += millisecondsSince(stageStart);
+										latencies.push_back(millisecondsSince(item.captureTime));
+
+										if (!item.decoded.empty())
+										{
+											decoded = item.decoded;
+											decodedLatency = latencies.back();
+											stop = true;
+											putText(item.frame, item.decoded, Point(50, 50), FONT_HERSHEY_SIMPLEX, 1,
+															Scalar(0, 255, 0), 2);
+											decodedFrame = item.frame;
+										}
+									}
+									displayQueue.close(); });
+
+	CameraFrame item;
+	while (displayQueue.pop(item))
+	{
+		auto stageStart = high_resolution_clock::now();
+		imshow("Dynamic Grid Detection", item.frame);
+		displayStatistics.count++;
+		displayStatistics.busyMilliseconds += millisecondsSince(stageStart);
+		int key = waitKey(1);
+		if (key > 0)
+		{
+			stop = true;
+		}
 	}
-	else if (isRightTriangle(distanceBetweenAC * distanceBetweenAC, distanceBetweenBC * distanceBetweenBC, distanceBetweenAB * distanceBetweenAB))
+
+	if (!decodedFrame.empty())
 	{
-		rightAngle = C;
-		topLeft = A;
-		bottomRight = B;
+		imshow("Dynamic Grid Detection", decodedFrame);
+		displayStatistics.count++;
+		waitKey(resultDisplayMilliseconds);
 	}
-	else
+
+	capture.join();
+	detect.join();
+	decode.join();
+
+	double seconds = millisecondsSince(startTime) / 1000.0;
+	printStageStatistics("Capture", captureStatistics, seconds);
+	printStageStatistics("Detect", detectStatistics, seconds);
+	printStageStatistics("Decode", decodeStatistics, seconds);
+	printStageStatistics("Display", displayStatistics, seconds);
+	if (track)
 	{
-		logFile << "[Align Image] [Error]: No right-angle triangle found" << endl;
-		throw invalid_argument("[Align Image] [Error]: No right-angle triangle found");
+		cerr << "[decodeCamera] Marker tracking - tracked frames: " << tracker.trackedFrames << ", full frame searches: " << tracker.fullSearches << endl;
 	}
-
-	// Explicitly assign top-left and bottom-right based on coordinates
-	// Top-left should have the smallest y-coordinate
-	// Bottom-right should have the largest x-coordinate
-	// This is to avoid the flip of the image
-	if (topLeft.y > bottomRight.y)
+	if (voteConfidence > 0.0)
 	{
-		swap(topLeft, bottomRight);
+		cerr << "[decodeCamera] Cell votes - decoded frames: " << votedFrames << ", confident cells: " << confidentCells << "%" << endl;
 	}
-	if (topLeft.x > bottomRight.x)
+	cerr << "[decodeCamera] Dropped frames - detect: " << detectQueue.droppedCount() << ", decode: " << decodeQueue.droppedCount()
+			 << ", display: " << displayQueue.droppedCount() << endl;
+	if (!latencies.empty())
 	{
-		swap(topLeft, bottomRight);
+		cerr << "[decodeCamera] Capture to decode latency - mean: " << accumulate(latencies.begin(), latencies.end(), 0.0) / latencies.size()
+				 << " ms, max: " << *max_element(latencies.begin(), latencies.end()) << " ms";
+		if (!decoded.empty())
+		{
+			cerr << ", decoded barcode: " << decodedLatency << " ms";
+		}
+		cerr << endl;
 	}
-
-	// Define source and destination points
-	vector<Point2f> src = {topLeft, rightAngle, bottomRight};
-
-	// Set destination points to a full-size square
-	// This canvas and region is based on the examples images
-	float targetCanvas = 1200.0f;
-	float barcodeRegion = 940.0f;
-	float padding = (targetCanvas - barcodeRegion) / 2.0f;
-
-	vector<Point2f> dst = {
-			Point2f(padding, padding),																// Top-left
-			Point2f(padding, padding + barcodeRegion),								// Bottom-left
-			Point2f(padding + barcodeRegion, padding + barcodeRegion) // Bottom-right
-	};
-
-	// Rotate based on the calculation
-	Mat affine = getAffineTransform(src, dst);
-	Mat aligned;
-	warpAffine(image, aligned, affine, Size(targetCanvas, targetCanvas), INTER_LINEAR, BORDER_CONSTANT, Scalar(255, 255, 255));
-
-	// Debug: Aligned image can be seen in debug-rotated.jpg under 'build' folder
-	imwrite("debug-rotated.jpg", aligned);
-	return aligned;
+	return decoded;
 }
 
 /// @brief Use ./src/main camera instead of ./src/main image.jpg to dynamically detect the barcode
@@ -423,19 +632,169 @@ Mat alignBarcodeImage(const Mat &image)
 /// @return
 int main(int argc, char **argv)
 {
-	// Validation; Argument should have two parameters.
-	if (argc != 2)
+	// Validation; Argument should have the input and optional flags.
+	if (argc < 2)
 	{
-		cerr << "[main] [Error]: " << argv[0] << " <input image file name> e.g. ./src/main 2DEmpty.jpg" << endl;
+		cerr << "[main] [Error]: " << argv[0] << " <input image file name | camera | --batch <directory>> [--output <results.jsonl>] [--threads <count>] [--debug] [--debug-every <frames>] [--sample <cell fraction>] [--no-track] [--pyramid] [--direct] [--multi] [--vote <confidence>] [--log <error|warning|info|debug>]"
+				 << " e.g. ./src/main 2DEmpty.jpg" << endl;
 		return -1;
 	}
 
 	try
 	{
-		const char *inputPath = argv[1];
+		string inputPath;
+		string outputPath;
+		bool batch = false;
+		bool debug = false;
+		bool track = true;
+		bool vote = false;
+		double voteConfidence = 0.0;
+		double sampleWindowFraction = 0.0;
+		bool pyramidDetection = false;
+		string logLevel;
+		int threadCount = max(1, static_cast<int>(thread::hardware_concurrency()));
+
+		for (int i = 1; i < argc; i++)
+		{
+			string argument = argv[i];
+			bool hasValue = i + 1 < argc;
+			if (argument == "--batch" && hasValue)
+			{
+				batch = true;
+				inputPath = argv[++i];
+			}
+			else if (argument == "--output" && hasValue)
+			{
+				outputPath = argv[++i];
+			}
+			else if (argument == "--threads" && hasValue)
+			{
+				threadCount = stoi(argv[++i]);
+			}
+			else if (argument == "--debug")
+			{
+				debug = true;
+			}
+			else if (argument == "--debug-every" && hasValue)
+			{
+				debugImageInterval = stoi(argv[++i]);
+			}
+			else if (argument == "--multi")
+			{
+				multiBarcode = true;
+			}
+			else if (argument == "--vote" && hasValue)
+			{
+				voteConfidence = stod(argv[++i]);
+				vote = true;
+			}
+			else if (argument == "--direct")
+			{
+				directSampling = true;
+			}
+			else if (argument == "--pyramid")
+			{
+				pyramidDetection = true;
+			}
+			else if (argument == "--no-track")
+			{
+				track = false;
+			}
+			else if (argument == "--sample" && hasValue)
+			{
+				sampleWindowFraction = stod(argv[++i]);
+			}
+			else if (argument == "--log" && hasValue)
+			{
+				logLevel = argv[++i];
+			}
+			else if (inputPath.empty() && argument.rfind("--", 0) != 0)
+			{
+				inputPath = argument;
+			}
+			else
+			{
+				throw invalid_argument("Unknown or incomplete argument: " + argument);
+			}
+		}
+
+		if (inputPath.empty())
+		{
+			throw invalid_argument("No input given");
+		}
+		if (threadCount < 1)
+		{
+			throw invalid_argument("--threads must be at least 1");
+		}
+		if (!outputPath.empty() && !batch)
+		{
+			throw invalid_argument("--output is only used with --batch");
+		}
+		if (debug && batch)
+		{
+			// Every image would overwrite the same debug images
+			throw invalid_argument("--debug writes debug images for a single image and cannot be used with --batch, use --log debug instead");
+		}
+		if (sampleWindowFraction < 0.0 || sampleWindowFraction > 1.0)
+		{
+			throw invalid_argument("--sample must be between 0 (center pixel) and 1 (whole cell)");
+		}
+		if (debugImageInterval < 1)
+		{
+			throw invalid_argument("--debug-every must be at least 1");
+		}
+		if (voteConfidence < 0.0 || voteConfidence > static_cast<double>(voteWindowFrames))
+		{
+			throw invalid_argument("--vote must be between 0 (first decoded frame) and " + to_string(voteWindowFrames) + " (every frame of the window pure)");
+		}
+		if (vote && (batch || inputPath != "camera"))
+		{
+			throw invalid_argument("--vote merges camera frames and is only used with camera");
+		}
+		if (vote && multiBarcode)
+		{
+			// The votes are kept per cell of a single barcode
+			throw invalid_argument("--vote cannot be used with --multi");
+		}
+
+		// Debug: log.txt is written by a background thread. --debug logs everything and writes the debug images.
+		map<string, LogLevel> logLevels = {{"error", LogLevel::Error}, {"warning", LogLevel::Warning}, {"info", LogLevel::Info}, {"debug", LogLevel::Debug}};
+		if (debug && logLevel.empty())
+		{
+			logLevel = "debug";
+		}
+		if (!logLevel.empty())
+		{
+			if (logLevels.count(logLevel) == 0)
+			{
+				throw invalid_argument("Unknown log level: " + logLevel);
+			}
+			logger().open("log.txt", logLevels[logLevel]);
+		}
+
+		// Decode a directory of images on all cores
+		if (batch)
+		{
+			int failures;
+			if (outputPath.empty())
+			{
+				failures = decodeBatch(inputPath, cout, threadCount, sampleWindowFraction, pyramidDetection);
+			}
+			else
+			{
+				ofstream output(outputPath);
+				if (!output)
+				{
+					throw invalid_argument("Could not open the output file: " + outputPath);
+				}
+				failures = decodeBatch(inputPath, output, threadCount, sampleWindowFraction, pyramidDetection);
+			}
+			logger().close();
+			return failures == 0 ? 0 : 1;
+		}
 
 		// For dynamic detection through the camera
-		if (string(inputPath) == "camera")
+		if (inputPath == "camera")
 		{
 			// Note: The dynamic image detection for computing padding is not completely reliable yet.
 			// If the image is significantly scaled, rotated, or distorted (e.g. from printing), the computed centers and padding might be inaccurate.
@@ -455,81 +814,14 @@ int main(int argc, char **argv)
 				return -1;
 			}
 
-			Mat frame;
-
-			while (true)
+			string result = decodeCamera(cap, debug, track, voteConfidence, sampleWindowFraction, pyramidDetection);
+			if (result.empty())
 			{
-				cap >> frame;
-				if (frame.empty())
-					break;
-
-				vector<Point2f> circles;
-				try
-				{
-					circles = detectBlueCircles(frame);
-					for (const Point2f &center : circles)
-					{
-						circle(frame, center, 30, Scalar(0, 0, 255), 2);
-						circle(frame, center, 4, Scalar(0, 255, 0), -1);
-					}
-					if (circles.size() != 3)
-					{
-						string msg = "Circles found: " + to_string(circles.size()) + " / 3";
-						putText(frame, msg, Point(50, 50),
-										FONT_HERSHEY_SIMPLEX, 1, Scalar(0, 0, 255), 2);
-						throw runtime_error("Not exactly 3 circles found");
-					}
-				}
-				catch (...)
-				{
-
-					imshow("Dynamic Grid Detection", frame);
-					int key = waitKey(10);
-					if (key > 0)
-					{
-						break;
-					}
-
-					continue;
-				}
-				Mat aligned;
-				try
-				{
-					aligned = alignBarcodeImage(frame);
-				}
-				catch (...)
-				{
-					putText(frame, "Alignment failed", Point(50, 100),
-									FONT_HERSHEY_SIMPLEX, 1, Scalar(0, 0, 255), 2);
-					imshow("Dynamic Grid Detection", frame);
-					waitKey(1);
-					continue;
-				}
-
-				try
-				{
-					string result = decodeBarcode(aligned);
-					if (!result.empty())
-					{
-						putText(frame, result, Point(50, 50), FONT_HERSHEY_SIMPLEX, 1,
-										Scalar(0, 255, 0), 2);
-						imshow("Dynamic Grid Detection", frame);
-						cout << "Decoded: " << result << endl;
-						break;
-					}
-				}
-				catch (...)
-				{
-					cerr << "[Error]: Decoding failed." << endl;
-				}
-
-				imshow("Dynamic Grid Detection", frame);
-				int key = waitKey(10);
-				if (key > 0)
-				{
-					break;
-				}
+				cerr << "[main] [Error]: Stopped before a barcode was decoded" << endl;
+				logger().close();
+				return -1;
 			}
+			cout << "Decoded: " << result << endl;
 		}
 		else
 		{
@@ -542,20 +834,49 @@ int main(int argc, char **argv)
 				return -1;
 			}
 
-			Mat alignedImage = alignBarcodeImage(inputImage);
-			string decoded = decodeBarcode(alignedImage);
+			vector<double> margins;
+			string decoded;
+			if (multiBarcode)
+			{
+				// Every barcode in view, one per line
+				for (const DecodedBarcode &barcode : decodeBarcodes(inputImage, detectAllBlueCircles(inputImage, pyramidDetection), debug, sampleWindowFraction))
+				{
+					if (!barcode.payload.empty())
+					{
+						decoded += (decoded.empty() ? "" : "\n") + barcode.payload;
+					}
+					else
+					{
+						cerr << "[main] [Error]: A barcode could not be decoded: " << barcode.error << endl;
+					}
+				}
+			}
+			else if (directSampling)
+			{
+				decoded = decodeBarcode(inputImage, getAlignmentTransform(detectBlueCircles(inputImage, pyramidDetection)), &margins, nullptr, debug, sampleWindowFraction);
+			}
+			else
+			{
+				Mat alignedImage = alignBarcodeImage(inputImage, debug, pyramidDetection);
+				decoded = decodeBarcode(alignedImage, &margins, nullptr, debug, sampleWindowFraction);
+			}
+			if (!margins.empty())
+			{
+				cerr << "[main] [Info]: Minimum cell confidence margin: " << *min_element(margins.begin(), margins.end()) << endl;
+			}
 
 			if (decoded.empty())
 			{
 				cerr << "[main] [Error]: Could not decode the barcode" << endl;
 				return -1;
 			}
+			cout << decoded << endl;
 		}
 
 		cout << "[main] [Debug] Successfully processed the barcode" << endl;
 
 		// Debug
-		logFile.close();
+		logger().close();
 
 		return 0;
 	}
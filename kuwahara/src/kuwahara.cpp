@@ -1,241 +1,799 @@
 #include <iostream>
-#include <opencv2/opencv.hpp>
-#include <string>
-#include <chrono>
+#include "kuwahara.hpp"
+#include <deque>
+#include <filesystem>
+#include <sstream>
 
 // Debug
 // #include <iostream>
-// #include <fstream>
 
-using namespace cv;
-using namespace std;
-using namespace chrono;
-
-/// @brief Struct to hold the coordinates of a quadrant.
-struct Quadrant
+/// @brief Struct to hold the command line options.
+struct KuwaharaOptions
 {
-	int y1, x1, y2, x2;
+	string inputPath;
+	string outputPath;
+	int kernelSize = 0;
+	vector<int> kernelSizes;
+	int threadCount = 1;
+	bool stream = false;
+	int stripRows = 256;
+	bool colour = false;
+	string filter = "kuwahara";
+	bool video = false;
+	int frameLimit = 0;
+	bool batch = false;
+	string editedPath;
+	Rect dirty;
+	bool approximate = false;
+	string guidePath;
+	double eps = -1.0;
 };
 
-/// @brief Struct to hold the mean and variance of a region.
-struct RegionStatistics
+/// @brief Generate mock image with 5x5
+/// @return 5x5 image with 32-bit signed integers
+Mat generate5x5MatImage()
 {
-	double mean = 0.0;
-	double variance = DBL_MAX;
-};
+	cv::Mat image(5, 5, CV_8U);
+	int counter = 0;
 
-/// @brief Calculate the mean and variance of a region.
-/// @details The region is defined by the top-left and bottom-right corners.
-/// The mean and variance are calculated using the integral images.
-/// The mean is calculated as:
-/// mean = sum / numberOfPixels
-/// The variance is calculated as:
-/// variance = (sqSum / numberOfPixels) - (mean * mean)
-/// @param sumImage Sum image
-/// @param sqSumImage  square sum image
-/// @param quad quadrant
-/// @return RegionStatistics
-RegionStatistics calculateRegionStatistics(const Mat &sumImage, const Mat &sqSumImage, const Quadrant &quad)
-{
-	RegionStatistics stats;
+	for (int row = 0; row < image.rows; ++row)
+	{
+		for (int col = 0; col < image.cols; ++col)
+		{
+			image.at<int>(row, col) = counter++;
+		}
+	}
+
+	return image;
+}
 
-	if (quad.y1 >= quad.y2 || quad.x1 >= quad.x2)
+/// @brief Output path of one kernel size when several are given, in the naming of the shipped references.
+/// e.g. limes_kuwahara.tif and 5 -> limes_kuwahara5x5.tif
+/// @param outputPath output path given on the command line
+/// @param kernelSize Kernel size
+/// @return output path of the kernel size
+string kernelOutputPath(const string &outputPath, int kernelSize)
+{
+	size_t extension = outputPath.find_last_of('.');
+	size_t directory = outputPath.find_last_of('/');
+	if (extension == string::npos || (directory != string::npos && extension < directory))
 	{
-		return stats;
+		extension = outputPath.size();
 	}
 
-	int numberOfPixels = (quad.y2 - quad.y1 + 1) * (quad.x2 - quad.x1 + 1);
+	string size = to_string(kernelSize);
+	return outputPath.substr(0, extension) + size + "x" + size + outputPath.substr(extension);
+}
 
-	double sum = sumImage.at<double>(quad.y2 + 1, quad.x2 + 1) -
-							 sumImage.at<double>(quad.y1, quad.x2 + 1) -
-							 sumImage.at<double>(quad.y2 + 1, quad.x1) +
-							 sumImage.at<double>(quad.y1, quad.x1);
+/// @brief Parse a rectangle given as x,y,width,height.
+/// @param text rectangle text, e.g. 10,20,64,48
+/// @return Rect
+Rect parseRect(const string &text)
+{
+	Rect rect;
+	char separators[3];
+	stringstream stream(text);
+	stream >> rect.x >> separators[0] >> rect.y >> separators[1] >> rect.width >> separators[2] >> rect.height;
 
-	double sqSum = sqSumImage.at<double>(quad.y2 + 1, quad.x2 + 1) -
-								 sqSumImage.at<double>(quad.y1, quad.x2 + 1) -
-								 sqSumImage.at<double>(quad.y2 + 1, quad.x1) +
-								 sqSumImage.at<double>(quad.y1, quad.x1);
+	if (!stream || separators[0] != ',' || separators[1] != ',' || separators[2] != ',' || rect.width <= 0 || rect.height <= 0)
+	{
+		throw invalid_argument("Rectangle should be x,y,width,height: " + text);
+	}
+	return rect;
+}
 
-	stats.mean = sum / numberOfPixels;
-	stats.variance = (sqSum / numberOfPixels) - (stats.mean * stats.mean);
+/// @brief Print the rows and processing time of each thread, below the Processing time: line.
+/// @param timings band timings
+void printBandTimings(const vector<BandTiming> &timings)
+{
+	// Per-thread time to check the scaling
+	for (size_t i = 0; i < timings.size(); i++)
+	{
+		cout << "  Thread " << i << " (rows " << timings[i].rowBegin << "-" << timings[i].rowEnd - 1 << "): " << timings[i].milliseconds << " milliseconds" << endl;
+	}
+}
 
-	return stats;
+/// @brief Apply the filter selected on the command line to one image.
+/// @param options command line options
+/// @param input Input image
+/// @param output Output image
+/// @param timings Optional output of the rows and processing time of each band
+/// @param guide Guide image of the guided filter, or empty for the self-guided filter
+void applyFilter(const KuwaharaOptions &options, const Mat &input, Mat &output, vector<BandTiming> *timings, const Mat &guide = Mat())
+{
+	if (options.filter == "sidewindow")
+	{
+		sideWindowFilter(input, output, options.kernelSize, options.threadCount, timings);
+	}
+	else if (options.filter == "adaptive")
+	{
+		adaptiveKuwaharaFilter(input, output, options.kernelSize, options.threadCount, timings);
+	}
+	else if (options.filter == "guided")
+	{
+		// Default regularisation: edges with a standard deviation above 10% of the pixel range are kept
+		double peak = input.depth() == CV_16U ? 65535.0 : 255.0;
+		double eps = options.eps >= 0.0 ? options.eps : 0.01 * peak * peak;
+		guidedFilter(input, guide, output, options.kernelSize, eps, options.threadCount, timings);
+	}
+	else if (options.filter == "lee")
+	{
+		leeFilter(input, output, options.kernelSize, options.eps, options.threadCount, timings);
+	}
+	else
+	{
+		kuwaharaFilter(input, output, options.kernelSize, options.threadCount, timings);
+	}
 }
 
-/// @brief Generate mock image with 5x5
-/// @return 5x5 image with 32-bit signed integers
-Mat generate5x5MatImage()
+/// @brief Filter a video file or a camera stream frame by frame and write the output video.
+/// @details The input is a video file under the root directory, or camera / camera:N for camera N. The output is
+/// written with MJPG, so an .avi name is expected. The filter time per frame is measured without decoding and encoding.
+/// @param options command line options
+/// @return exit code
+int filterVideo(const KuwaharaOptions &options)
 {
-	cv::Mat image(5, 5, CV_8U);
-	int counter = 0;
+	VideoCapture capture;
+	if (options.inputPath.rfind("camera", 0) == 0)
+	{
+		size_t separator = options.inputPath.find(':');
+		capture.open(separator == string::npos ? 0 : atoi(options.inputPath.c_str() + separator + 1));
+	}
+	else
+	{
+		capture.open("../" + options.inputPath);
+	}
 
-	for (int row = 0; row < image.rows; ++row)
+	if (!capture.isOpened())
 	{
-		for (int col = 0; col < image.cols; ++col)
+		cerr << "!! Input Video cannot be opened." << endl;
+		return -1;
+	}
+
+	double inputFps = capture.get(CAP_PROP_FPS);
+	string fullOutputPath = "../" + options.outputPath;
+	VideoWriter writer;
+	KuwaharaContext context(options.kernelSize, options.threadCount, options.colour);
+
+	Mat frame;
+	double filterMilliseconds = 0.0;
+	vector<BandTiming> totalTimings(context.bandTimings.size());
+	auto startTime = high_resolution_clock::now();
+
+	while ((options.frameLimit == 0 || context.frameCount < options.frameLimit) && capture.read(frame))
+	{
+		auto frameStart = high_resolution_clock::now();
+		const Mat &outputFrame = context.apply(frame);
+		auto frameStop = high_resolution_clock::now();
+		filterMilliseconds += duration_cast<microseconds>(frameStop - frameStart).count() / 1000.0;
+
+		for (size_t i = 0; i < totalTimings.size(); i++)
 		{
-			image.at<int>(row, col) = counter++;
+			totalTimings[i].rowBegin = context.bandTimings[i].rowBegin;
+			totalTimings[i].rowEnd = context.bandTimings[i].rowEnd;
+			totalTimings[i].milliseconds += context.bandTimings[i].milliseconds;
 		}
+
+		if (!writer.isOpened())
+		{
+			writer.open(fullOutputPath, VideoWriter::fourcc('M', 'J', 'P', 'G'), inputFps > 0 ? inputFps : 30.0, outputFrame.size(), outputFrame.channels() == 3);
+
+			if (!writer.isOpened())
+			{
+				cerr << "!! Output Video cannot be written." << endl;
+				return -1;
+			}
+		}
+		writer.write(outputFrame);
 	}
 
-	return image;
+	auto stopTime = high_resolution_clock::now();
+	double totalMilliseconds = duration_cast<microseconds>(stopTime - startTime).count() / 1000.0;
+
+	if (context.frameCount == 0)
+	{
+		cerr << "!! No frames could be read." << endl;
+		return -1;
+	}
+
+	// Per-thread times are averaged over the frames
+	for (BandTiming &timing : totalTimings)
+	{
+		timing.milliseconds /= context.frameCount;
+	}
+
+	cout << "Frames: " << context.frameCount << endl;
+	cout << "Processing time: " << filterMilliseconds / context.frameCount << " milliseconds per frame" << endl;
+	printBandTimings(totalTimings);
+	cout << "Filter FPS: " << context.frameCount * 1000.0 / filterMilliseconds << ". FPS with decoding and encoding: " << context.frameCount * 1000.0 / totalMilliseconds << endl;
+	cout << "Buffer reallocations after the first frame: " << context.reallocationCount << endl;
+	cout << "Successfully applied Kuwahara Filter." << endl;
+	return 0;
 }
 
-/// @brief Get quadrants of the image.
-/// @details The quadrants are defined as follows:
-/// A: Top-left, B: Top-right, C: Bottom-left, D: Bottom-right
-/// @param x column index
-/// @param y row index
-/// @param halfKernel half of the kernel size
-/// @param rows rows of the image
-/// @param cols columns of the image
-/// @return vector of quadrants
-vector<Quadrant> getQuadrants(int x, int y, int halfKernel, int rows, int cols)
+/// @brief Blocking queue with a fixed capacity, between two stages of the batch pipeline.
+/// @details push() waits while the queue is full, so a fast stage cannot run ahead of a slow one by more than
+/// capacity items. pop() waits while the queue is empty and returns false once the queue is closed and drained.
+template <typename T>
+struct BoundedQueue
 {
-	return {
-			// A
-			{max(0, y - halfKernel), max(0, x - halfKernel), y, x},
+	explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+	/// @brief Add an item, waiting while the queue is full.
+	void push(T item)
+	{
+		unique_lock<mutex> lock(queueMutex);
+		notFull.wait(lock, [this]()
+								 { return items.size() < capacity; });
+		items.push_back(move(item));
+		notEmpty.notify_one();
+	}
 
-			// B
-			{max(0, y - halfKernel), x, y, min(cols - 1, x + halfKernel)},
+	/// @brief Take the oldest item, waiting while the queue is empty.
+	/// @return false when the queue is closed and there are no items left
+	bool pop(T &item)
+	{
+		unique_lock<mutex> lock(queueMutex);
+		notEmpty.wait(lock, [this]()
+									{ return !items.empty() || closed; });
 
-			// C
-			{y, max(0, x - halfKernel), min(rows - 1, y + halfKernel), x},
+		if (items.empty())
+		{
+			return false;
+		}
 
-			// D
-			{y, x, min(rows - 1, y + halfKernel), min(cols - 1, x + halfKernel)}};
-}
+		item = move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	/// @brief No more items will be pushed. Wakes the consumer once the queue is drained.
+	void close()
+	{
+		lock_guard<mutex> lock(queueMutex);
+		closed = true;
+		notEmpty.notify_all();
+	}
 
-/// @brief Calculate Integral Image and Sqaure Integraal Image. (Summed Area Tables (SAT))
-/// @details SAT tables will be used to calculate the mean and variances of regions in Kuwahara Filter
-/// The details of the algorithm can be found in https://en.wikipedia.org/wiki/Summed-area_table#:~:text=In%20the%20image%20processing%20domain,Crow%20for%20use%20with%20mipmaps.
-/// e.g arguments - ./src/kuwahara limes.tif output1.jpg 5
-/// e.g. arguments for debugging - ./src/kuwahara debug output1.jpg 5
-/// @param input input Image to calculate Sum and Square Sum images
-/// @param sumImage output Sum Image
-/// @param sqSumImage output Square Sum Image
-void calculateIntegralImages(const Mat &input, Mat &sumImage, Mat &sqSumImage)
+private:
+	size_t capacity;
+	deque<T> items;
+	bool closed = false;
+	mutex queueMutex;
+	condition_variable notEmpty;
+	condition_variable notFull;
+};
+
+/// @brief Number of images waiting between two stages of the batch pipeline.
+const size_t batchQueueCapacity = 4;
+
+/// @brief One image passing through the batch pipeline.
+struct BatchItem
+{
+	string fileName;
+	Mat image;
+};
+
+/// @brief Struct to hold the image count and the busy time of each stage of the batch pipeline.
+struct BatchStatistics
 {
-	// When creating the integral image, it is convenient to create a matrix (or IplImage)
-	// with one extra column and one extra row, both initialised to zero. This is to avoid when x or y becomes -1
-	sumImage = Mat::zeros(input.rows + 1, input.cols + 1, CV_64F);
-	sqSumImage = Mat::zeros(input.rows + 1, input.cols + 1, CV_64F);
+	int imageCount = 0;
+	int failureCount = 0;
+	double decodeMilliseconds = 0.0;
+	double filterMilliseconds = 0.0;
+	double encodeMilliseconds = 0.0;
+	double totalMilliseconds = 0.0;
+};
 
-	// Fill integral images row by row. Iterate the height (rows) first
-	for (int y = 0; y < input.rows; y++)
+/// @brief Get the input images of the batch mode.
+/// @param inputPath directory, every image in it is used, or a text file with one image path per line
+/// @return image paths, sorted for a directory
+vector<string> getBatchInputPaths(const string &inputPath)
+{
+	vector<string> inputPaths;
+
+	if (filesystem::is_directory(inputPath))
 	{
-		// Iterate the width (cols) of the image
-		for (int x = 0; x < input.cols; x++)
+		for (const auto &entry : filesystem::directory_iterator(inputPath))
 		{
-			// Get pixel value (as double for precision)
-			double pixel = input.at<double>(y, x);
-			double pixelSq = pixel * pixel;
-
-			// Calculate sums (+1 because integral images have extra row/col)
-			// I(x,y) = i(x,y) + I(x-1, y) + I(x,y -1) +  - I(x-1, y-1). In Matrix, element is accessed by matrix[row, col] = matrix [y,x]
-			sumImage.at<double>(y + 1, x + 1) = pixel +
-																					sumImage.at<double>(y, x + 1) +
-																					sumImage.at<double>(y + 1, x) -
-																					sumImage.at<double>(y, x);
-
-			// Sqaure Sum will be used to calculate variance
-			sqSumImage.at<double>(y + 1, x + 1) = pixelSq +
-																						sqSumImage.at<double>(y, x + 1) +
-																						sqSumImage.at<double>(y + 1, x) -
-																						sqSumImage.at<double>(y, x);
+			if (!entry.is_regular_file())
+			{
+				continue;
+			}
+
+			// haveImageReader() reads the file header. If that throws, the file is kept, so the decode stage reports it
+			// as a failed image instead of the whole batch stopping.
+			bool isImage = true;
+			try
+			{
+				isImage = haveImageReader(entry.path().string());
+			}
+			catch (const cv::Exception &)
+			{
+			}
+
+			if (isImage)
+			{
+				inputPaths.push_back(entry.path().string());
+			}
 		}
+		sort(inputPaths.begin(), inputPaths.end());
+		return inputPaths;
+	}
+
+	ifstream listFile(inputPath);
+	if (!listFile)
+	{
+		throw invalid_argument("Cannot open " + inputPath);
 	}
+
+	// Paths in the list are relative to the root directory, like the command line paths
+	string line;
+	while (getline(listFile, line))
+	{
+		if (!line.empty() && line.back() == '\r')
+		{
+			line.pop_back();
+		}
+		if (!line.empty())
+		{
+			inputPaths.push_back("../" + line);
+		}
+	}
+	return inputPaths;
 }
 
-/// @brief This works by four big four steps
-/// 1. Calculate the integral image and square integral image. Still Big O(n) time compexity.
-/// 2. Calculate the mean and variance of each region
-/// 3. Find the region with the smallest variance
-/// 4. Set the output pixel to the mean of the region with the smallest variance
-/// @param input Input image
-/// @param output Output image
-/// @param kernelSize Kernel size
-void kuwaharaFilter(const Mat &input, Mat &output, int kernelSize)
+/// @brief Filter many images with decoding, filtering and encoding overlapped on three stages.
+/// @details The decode and encode stages have one thread each and the filter stage uses threadCount row bands.
+/// The stages are connected by BoundedQueues, so at most a few decoded images are in memory at a time.
+/// The busy time of each stage (without waiting on the queues) divided by the total time is its utilisation: the
+/// stage close to 100% is the bottleneck.
+/// Images that cannot be read, filtered or written, including files on which OpenCV throws, are counted as failures
+/// and skipped. The other images go on through the pipeline.
+/// @param inputPaths image paths
+/// @param outputDirectory output directory, created if missing. Outputs keep the input file names.
+/// @param options command line options, for the filter and the kernel size
+/// @return BatchStatistics
+BatchStatistics kuwaharaFilterBatch(const vector<string> &inputPaths, const string &outputDirectory, const KuwaharaOptions &options)
 {
-	// Debug
-	// std::ofstream logFile("log.txt");
+	filesystem::create_directories(outputDirectory);
 
-	// Create output image
-	output = Mat(input.size(), input.type());
-	int halfKernelSize = kernelSize / 2;
+	BatchStatistics statistics;
+	BoundedQueue<BatchItem> decodedQueue(batchQueueCapacity);
+	BoundedQueue<BatchItem> filteredQueue(batchQueueCapacity);
+	mutex failureMutex;
+	auto startTime = high_resolution_clock::now();
 
-	// Calculate integral images before to be used without complexiing the code
-	// According to the book, it might be safer to convert to double. Or we can calculate the max by max = width*height*255
-	Mat sumImage, sqSumImage;
-	Mat inputDoubleImage;
-	input.convertTo(inputDoubleImage, CV_64F);
+	auto reportFailure = [&](const string &message)
+	{
+		lock_guard<mutex> lock(failureMutex);
+		statistics.failureCount++;
+		cerr << "!! " << message << endl;
+	};
+
+	thread decoder([&]()
+								 {
+									 for (const string &inputPath : inputPaths)
+									 {
+										 auto decodeStart = high_resolution_clock::now();
+										 BatchItem item;
+										 item.fileName = filesystem::path(inputPath).filename().string();
+										 string error;
+										 try
+										 {
+											 item.image = imread(inputPath, options.colour ? IMREAD_COLOR : IMREAD_GRAYSCALE | IMREAD_ANYDEPTH);
+										 }
+										 catch (const std::exception &e)
+										 {
+											 // A corrupt file must not terminate the decode thread and with it the batch
+											 error = string(": ") + e.what();
+											 item.image.release();
+										 }
+										 auto decodeStop = high_resolution_clock::now();
+										 statistics.decodeMilliseconds += duration_cast<microseconds>(decodeStop - decodeStart).count() / 1000.0;
+
+										 if (item.image.empty())
+										 {
+											 reportFailure("Input Image cannot be read: " + inputPath + error);
+											 continue;
+										 }
+										 decodedQueue.push(move(item));
+									 }
+									 decodedQueue.close();
+								 });
+
+	thread filter([&]()
+								{
+									BatchItem item;
+									while (decodedQueue.pop(item))
+									{
+										auto filterStart = high_resolution_clock::now();
+										BatchItem filtered;
+										filtered.fileName = item.fileName;
+										try
+										{
+											applyFilter(options, item.image, filtered.image, nullptr);
+										}
+										catch (const std::exception &e)
+										{
+											reportFailure(item.fileName + ": " + e.what());
+											continue;
+										}
+										auto filterStop = high_resolution_clock::now();
+										statistics.filterMilliseconds += duration_cast<microseconds>(filterStop - filterStart).count() / 1000.0;
+
+										filteredQueue.push(move(filtered));
+									}
+									filteredQueue.close();
+								});
+
+	thread encoder([&]()
+								 {
+									 BatchItem item;
+									 while (filteredQueue.pop(item))
+									 {
+										 auto encodeStart = high_resolution_clock::now();
+										 string outputPath = (filesystem::path(outputDirectory) / item.fileName).string();
+										 bool written = false;
+										 try
+										 {
+											 written = imwrite(outputPath, item.image);
+										 }
+										 catch (const cv::Exception &)
+										 {
+											 written = false;
+										 }
+										 auto encodeStop = high_resolution_clock::now();
+										 statistics.encodeMilliseconds += duration_cast<microseconds>(encodeStop - encodeStart).count() / 1000.0;
+
+										 if (written)
+										 {
+											 statistics.imageCount++;
+										 }
+										 else
+										 {
+											 reportFailure("Output Image cannot be written: " + outputPath);
+										 }
+									 }
+								 });
+
+	decoder.join();
+	filter.join();
+	encoder.join();
+
+	auto stopTime = high_resolution_clock::now();
+	statistics.totalMilliseconds = duration_cast<microseconds>(stopTime - startTime).count() / 1000.0;
+	return statistics;
+}
+
+/// @brief Run the batch mode and print the throughput and the utilisation of each stage.
+/// @param options command line options. The input is a directory or a list file, the output a directory.
+/// @return exit code
+int filterBatch(const KuwaharaOptions &options)
+{
+	vector<string> inputPaths = getBatchInputPaths("../" + options.inputPath);
+	if (inputPaths.empty())
+	{
+		cerr << "!! No input images found." << endl;
+		return -1;
+	}
 
-	// Calculate integral images already to improve performance
-	calculateIntegralImages(inputDoubleImage, sumImage, sqSumImage);
+	BatchStatistics statistics = kuwaharaFilterBatch(inputPaths, "../" + options.outputPath, options);
 
-	// Rows
-	for (int y = 0; y < input.rows; y++)
+	double seconds = statistics.totalMilliseconds / 1000.0;
+	cout << "Images: " << statistics.imageCount << ". Failed: " << statistics.failureCount << endl;
+	cout << "Processing time: " << statistics.totalMilliseconds << " milliseconds" << endl;
+	cout << "Images per second: " << statistics.imageCount / seconds << endl;
+	cout << "Stage utilisation - Decode: " << 100.0 * statistics.decodeMilliseconds / statistics.totalMilliseconds
+			 << "%. Filter: " << 100.0 * statistics.filterMilliseconds / statistics.totalMilliseconds
+			 << "%. Encode: " << 100.0 * statistics.encodeMilliseconds / statistics.totalMilliseconds << "%" << endl;
+
+	if (statistics.failureCount > 0)
+	{
+		return -1;
+	}
+	cout << "Successfully applied Kuwahara Filter." << endl;
+	return 0;
+}
+
+/// @brief Filter the input, then update the output for an edited copy of it, and compare with a full recompute.
+/// @param options command line options
+/// @param inputImage original input image
+/// @return exit code
+int filterEdited(const KuwaharaOptions &options, const Mat &inputImage)
+{
+	Mat editedImage = imread("../" + options.editedPath, options.colour ? IMREAD_COLOR : IMREAD_GRAYSCALE | IMREAD_ANYDEPTH);
+	if (editedImage.empty())
+	{
+		cerr << "!! Edited Image cannot be read." << endl;
+		return -1;
+	}
+
+	KuwaharaState state;
+	auto startTime = high_resolution_clock::now();
+	kuwaharaFilterInit(state, inputImage, options.kernelSize, options.threadCount);
+	auto stopTime = high_resolution_clock::now();
+	cout << "Processing time: " << duration_cast<microseconds>(stopTime - startTime).count() / 1000.0 << " milliseconds" << endl;
+
+	startTime = high_resolution_clock::now();
+	Rect updated = kuwaharaFilterUpdate(state, editedImage, options.dirty);
+	stopTime = high_resolution_clock::now();
+	cout << "Incremental update time: " << duration_cast<microseconds>(stopTime - startTime).count() / 1000.0 << " milliseconds. Recomputed "
+			 << updated.width << "x" << updated.height << " of " << inputImage.cols << "x" << inputImage.rows << " pixels" << endl;
+
+	// The edited image outside the dirty rectangle should be the original one, so compare with the state's input
+	Mat fullOutput;
+	kuwaharaFilter(state.input, fullOutput, options.kernelSize, options.threadCount);
+	cout << "Max difference to a full recompute: " << norm(fullOutput, state.output, NORM_INF) << endl;
+
+	imwrite("../" + options.outputPath, state.output);
+	cout << "Successfully applied Kuwahara Filter." << endl;
+	return 0;
+}
+
+/// @brief Run the approximate pyramid filter and report its speedup and error against the exact filter.
+/// @param options command line options
+/// @param inputImage input image
+/// @return exit code
+int filterApproximate(const KuwaharaOptions &options, const Mat &inputImage)
+{
+	auto startTime = high_resolution_clock::now();
+	Mat outputImage;
+	pyramidKuwaharaFilter(inputImage, outputImage, options.kernelSize, options.threadCount);
+	auto stopTime = high_resolution_clock::now();
+	double approximateMilliseconds = duration_cast<microseconds>(stopTime - startTime).count() / 1000.0;
+
+	startTime = high_resolution_clock::now();
+	Mat exactImage;
+	kuwaharaFilter(inputImage, exactImage, options.kernelSize, options.threadCount);
+	stopTime = high_resolution_clock::now();
+	double exactMilliseconds = duration_cast<microseconds>(stopTime - startTime).count() / 1000.0;
+
+	double peak = inputImage.depth() == CV_16U ? 65535.0 : 255.0;
+	cout << "Processing time: " << approximateMilliseconds << " milliseconds (downsampled by " << pyramidFactor(options.kernelSize / 2) << ")" << endl;
+	cout << "Exact processing time: " << exactMilliseconds << " milliseconds. Speedup: " << exactMilliseconds / approximateMilliseconds << "x" << endl;
+	cout << "Error against the exact filter - Max difference: " << norm(outputImage, exactImage, NORM_INF) << ". PSNR: " << PSNR(outputImage, exactImage, peak) << " dB" << endl;
+
+	imwrite("../" + options.outputPath, outputImage);
+	cout << "Successfully applied Kuwahara Filter." << endl;
+	return 0;
+}
+
+/// @brief Parse the command line arguments.
+/// @details The first three arguments are positional: <input> <output> <kernel_size>.
+/// kernel_size can be a comma separated list, e.g. 5,7,9, to produce one output per size.
+/// Optional flags follow them:
+/// --threads N  number of threads used by the filter. Defaults to all cores.
+/// --stream  read and write binary PGM images in strips, with bounded memory
+/// --strip-rows N  rows per strip in streaming mode. Defaults to 256.
+/// --colour  filter the BGR image instead of converting it to grayscale
+/// --filter NAME  kuwahara (default), sidewindow, adaptive, guided or lee
+/// --guide PATH  guide image of the guided filter. Defaults to the input itself.
+/// --eps X  regularisation of the guided filter, or noise variance of the Lee filter, in squared pixel values
+/// --video  the input is a video file, or camera / camera:N for a camera, and the output is a video file
+/// --frames N  stop after N frames of a video. Defaults to all frames.
+/// --batch  the input is a directory or a file with one image path per line, and the output is a directory
+/// --edited PATH --dirty x,y,w,h  filter the input, then update the output for the edited image incrementally
+/// --approximate  pyramid approximation for kernel sizes up to maxApproximateKernelSize, compared with the exact filter
+/// @param argc argument count
+/// @param argv argument values
+/// @return KuwaharaOptions
+KuwaharaOptions parseOptions(int argc, char **argv)
+{
+	KuwaharaOptions options;
+	options.inputPath = argv[1];
+	options.outputPath = argv[2];
+
+	stringstream kernelSizeList(argv[3]);
+	string kernelSize;
+	while (getline(kernelSizeList, kernelSize, ','))
+	{
+		options.kernelSizes.push_back(atoi(kernelSize.c_str()));
+	}
+	if (options.kernelSizes.empty())
 	{
-		// Then columns
-		for (int x = 0; x < input.cols; x++)
+		throw invalid_argument("Kernel size is missing");
+	}
+	options.kernelSize = options.kernelSizes.front();
+	options.threadCount = max(1u, thread::hardware_concurrency());
+
+	for (int i = 4; i < argc; i++)
+	{
+		string flag = argv[i];
+
+		if (flag == "--threads" && i + 1 < argc)
 		{
-			auto quadrants = getQuadrants(x, y, halfKernelSize, input.rows, input.cols);
-
-			// Debug: Log each region's values to the log.txt file for debugging
-			// for (int i = 0; i < 4; i++)
-			// {
-			// 	logFile << "Region " << i + 1 << ": ";
-			// 	logFile << "Row " << quadrants[i][0] << " to " << quadrants[i][2] << ", ";
-			// 	logFile << "Col " << quadrants[i][1] << " to " << quadrants[i][3] << std::endl;
-			// }
-
-			// Calculate mean and variance for each region
-			double minVariance = DBL_MAX;
-			double meanWithSmallestVariance = 0.0;
-
-			// Loop through quadrants
-			for (const Quadrant &quad : quadrants)
+			options.threadCount = atoi(argv[++i]);
+
+			if (options.threadCount < 1)
 			{
-				RegionStatistics stats = calculateRegionStatistics(sumImage, sqSumImage, quad);
+				throw invalid_argument("--threads should be a positive number");
+			}
+		}
+		else if (flag == "--stream")
+		{
+			options.stream = true;
+		}
+		else if (flag == "--filter" && i + 1 < argc)
+		{
+			options.filter = argv[++i];
 
-				if (stats.variance < minVariance)
-				{
-					minVariance = stats.variance;
-					meanWithSmallestVariance = stats.mean;
-				}
+			if (options.filter != "kuwahara" && options.filter != "sidewindow" && options.filter != "adaptive" &&
+					options.filter != "guided" && options.filter != "lee")
+			{
+				throw invalid_argument("Unknown filter " + options.filter);
 			}
+		}
+		else if (flag == "--colour")
+		{
+			options.colour = true;
+		}
+		else if (flag == "--video")
+		{
+			options.video = true;
+		}
+		else if (flag == "--batch")
+		{
+			options.batch = true;
+		}
+		else if (flag == "--guide" && i + 1 < argc)
+		{
+			options.guidePath = argv[++i];
+		}
+		else if (flag == "--eps" && i + 1 < argc)
+		{
+			options.eps = atof(argv[++i]);
 
-			// Set output pixel to the mean of the region with the smallest variance
-			output.at<uchar>(y, x) = saturate_cast<uchar>(meanWithSmallestVariance);
+			if (options.eps < 0.0)
+			{
+				throw invalid_argument("--eps should not be negative");
+			}
+		}
+		else if (flag == "--approximate")
+		{
+			options.approximate = true;
+		}
+		else if (flag == "--edited" && i + 1 < argc)
+		{
+			options.editedPath = argv[++i];
 		}
+		else if (flag == "--dirty" && i + 1 < argc)
+		{
+			options.dirty = parseRect(argv[++i]);
+		}
+		else if (flag == "--frames" && i + 1 < argc)
+		{
+			options.frameLimit = atoi(argv[++i]);
+
+			if (options.frameLimit < 1)
+			{
+				throw invalid_argument("--frames should be a positive number");
+			}
+		}
+		else if (flag == "--strip-rows" && i + 1 < argc)
+		{
+			options.stripRows = atoi(argv[++i]);
+
+			if (options.stripRows < 1)
+			{
+				throw invalid_argument("--strip-rows should be a positive number");
+			}
+		}
+		else
+		{
+			throw invalid_argument("Unknown option " + flag);
+		}
+	}
+
+	if (options.stream && (options.colour || options.filter != "kuwahara"))
+	{
+		throw invalid_argument("--stream only supports the Kuwahara filter on grayscale PGM images");
+	}
+
+	if (options.video && (options.stream || options.filter != "kuwahara"))
+	{
+		throw invalid_argument("--video only supports the Kuwahara filter");
+	}
+
+	if (options.batch && (options.stream || options.video))
+	{
+		throw invalid_argument("--batch cannot be combined with --stream or --video");
+	}
+
+	if (options.editedPath.empty() != options.dirty.empty())
+	{
+		throw invalid_argument("--edited and --dirty have to be given together");
+	}
+
+	if (!options.editedPath.empty() && (options.stream || options.video || options.batch || options.filter != "kuwahara"))
+	{
+		throw invalid_argument("--edited only supports the Kuwahara filter on single images");
+	}
+
+	if (options.approximate && (options.stream || options.video || options.batch || options.colour || !options.editedPath.empty() || options.filter != "kuwahara" || options.kernelSizes.size() > 1))
+	{
+		throw invalid_argument("--approximate only supports the Kuwahara filter on single grayscale images");
+	}
+
+	if ((options.filter == "adaptive" || options.filter == "guided" || options.filter == "lee") && options.colour)
+	{
+		throw invalid_argument("The " + options.filter + " filter only supports grayscale images");
+	}
+
+	if (!options.guidePath.empty() && (options.filter != "guided" || options.batch))
+	{
+		throw invalid_argument("--guide is only used by the guided filter on single images");
+	}
+
+	if (options.kernelSizes.size() > 1 && (options.stream || options.video || options.batch || !options.editedPath.empty() || options.colour || options.filter != "kuwahara"))
+	{
+		throw invalid_argument("Several kernel sizes are only supported by the grayscale Kuwahara filter");
 	}
 
-	// Debug
-	// logFile.close();
+	return options;
 }
 
 int main(int argc, char **argv)
 {
-	// Argument Validation. Argument should have three parameters.
-	if (argc != 4)
+	// Argument Validation. Argument should have at least three parameters.
+	if (argc < 4)
 	{
-		cerr << "!! Wrong Arguments. " << argv[0] << " <input> <output> <kernel_size>. e.g. ./src/kuwahara limes_kuwahara5x5.tif output1.jpg 5" << endl;
+		cerr << "!! Wrong Arguments. " << argv[0] << " <input> <output> <kernel_size> [--threads N] [--stream] [--strip-rows N] [--colour] [--filter kuwahara|sidewindow|adaptive|guided|lee] [--guide PATH] [--eps X] [--video] [--frames N] [--batch] [--edited PATH --dirty x,y,w,h] [--approximate]. e.g. ./src/kuwahara limes_kuwahara5x5.tif output1.jpg 5 or 5,7,9" << endl;
 		return -1;
 	}
 
 	try
 	{
 		// Parse Arguments
-		const char *inputPath = argv[1];
-		const char *outputPath = argv[2];
-		int kernelSize = atoi(argv[3]);
+		KuwaharaOptions options = parseOptions(argc, argv);
+		const char *inputPath = options.inputPath.c_str();
+		const char *outputPath = options.outputPath.c_str();
+		int kernelSize = options.kernelSize;
 
-		cout << "Arguments - Input: " << inputPath << ". Output: " << outputPath << ". Kernel Size: " << kernelSize << endl;
+		cout << "Arguments - Input: " << inputPath << ". Output: " << outputPath << ". Kernel Size: " << argv[3] << ". Threads: " << options.threadCount << endl;
 
 		// Kernel Size Validation. Odd nubmer works better.
-		if (kernelSize % 2 == 0 || kernelSize < 3 || kernelSize > 15)
+		int maxKernelSize = options.approximate ? maxApproximateKernelSize : 15;
+		for (int size : options.kernelSizes)
 		{
-			cerr << "!! Kernel Size should be odd and between 3 and 15." << endl;
-			return -1;
+			if (size % 2 == 0 || size < 3 || size > maxKernelSize)
+			{
+				cerr << "!! Kernel Size should be odd and between 3 and " << maxKernelSize << "." << endl;
+				return -1;
+			}
+		}
+
+		// Streaming mode reads and writes the images itself, strip by strip
+		if (options.stream)
+		{
+			auto startTime = high_resolution_clock::now();
+
+			StreamStatistics statistics;
+			kuwaharaFilterStream("../" + options.inputPath, "../" + options.outputPath, kernelSize, options.stripRows, options.threadCount, statistics);
+
+			auto stopTime = high_resolution_clock::now();
+			auto duration = duration_cast<microseconds>(stopTime - startTime);
+			cout << "Processing time: " << duration.count() / 1000.0 << " milliseconds" << endl;
+			for (size_t i = 0; i < statistics.threadMilliseconds.size(); i++)
+			{
+				cout << "  Thread " << i << ": " << statistics.threadMilliseconds[i] << " milliseconds" << endl;
+			}
+			cout << "Streaming memory - Integral window: " << statistics.windowBytes / 1024 << " KB. Strips: " << statistics.stripBytes / 1024 << " KB" << endl;
+			cout << "Successfully applied Kuwahara Filter." << endl;
+			return 0;
+		}
+
+		// Video mode filters every frame with one reusable context
+		if (options.video)
+		{
+			return filterVideo(options);
+		}
+
+		// Batch mode decodes, filters and encodes a directory of images on three threads
+		if (options.batch)
+		{
+			return filterBatch(options);
 		}
 
 		// Read Image. The image should be under the root directory. Otherwise change the path below.
@@ -247,7 +805,8 @@ int main(int argc, char **argv)
 		else
 		{
 			string fullInputPath = "../" + string(inputPath);
-			inputImage = imread(fullInputPath, IMREAD_GRAYSCALE);
+			// Any depth keeps 16-bit images (e.g. TIFF) at full precision
+			inputImage = imread(fullInputPath, options.colour ? IMREAD_COLOR : IMREAD_GRAYSCALE | IMREAD_ANYDEPTH);
 
 			if (inputImage.empty())
 			{
@@ -256,16 +815,67 @@ int main(int argc, char **argv)
 			}
 		}
 
+		// Approximate filter for large kernels, compared with the exact one
+		if (options.approximate)
+		{
+			return filterApproximate(options, inputImage);
+		}
+
+		// Incremental update after an edit
+		if (!options.editedPath.empty())
+		{
+			return filterEdited(options, inputImage);
+		}
+
+		// Several kernel sizes share one integral image and one sweep over the rows
+		if (options.kernelSizes.size() > 1)
+		{
+			auto startTime = high_resolution_clock::now();
+
+			vector<Mat> outputImages;
+			vector<BandTiming> timings;
+			kuwaharaFilterMulti(inputImage, outputImages, options.kernelSizes, options.threadCount, &timings);
+
+			auto stopTime = high_resolution_clock::now();
+			auto duration = duration_cast<microseconds>(stopTime - startTime);
+			cout << "Processing time: " << duration.count() / 1000.0 << " milliseconds" << endl;
+			printBandTimings(timings);
+
+			for (size_t i = 0; i < outputImages.size(); i++)
+			{
+				string fullOutputPath = "../" + kernelOutputPath(options.outputPath, options.kernelSizes[i]);
+				imwrite(fullOutputPath, outputImages[i]);
+				cout << "Output: " << fullOutputPath << endl;
+			}
+			cout << "Successfully applied Kuwahara Filter." << endl;
+			return 0;
+		}
+
+		// Cross-guided filter
+		Mat guideImage;
+		if (!options.guidePath.empty())
+		{
+			guideImage = imread("../" + options.guidePath, IMREAD_GRAYSCALE | IMREAD_ANYDEPTH);
+
+			if (guideImage.empty())
+			{
+				cerr << "!! Guide Image cannot be read." << endl;
+				return -1;
+			}
+		}
+
 		// Timer starts
 		auto startTime = high_resolution_clock::now();
 
 		Mat outputImage;
-		kuwaharaFilter(inputImage, outputImage, kernelSize);
+		vector<BandTiming> timings;
+		applyFilter(options, inputImage, outputImage, &timings, guideImage);
 
 		// Measure time
 		auto stopTime = high_resolution_clock::now();
 		auto duration = duration_cast<microseconds>(stopTime - startTime);
 		cout << "Processing time: " << duration.count() / 1000.0 << " milliseconds" << endl;
+		printBandTimings(timings);
 
 		// The image should be under the root directory. Otherwise change the path below.
 		string fullOutputPath = "../" + string(outputPath);
@@ -0,0 +1,2174 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core/hal/intrin.hpp>
+#include <array>
+#include <string>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Kuwahara filters, shared by the kuwahara tool and the kuwahara_test regression and benchmark.
+
+using namespace cv;
+using namespace std;
+using namespace chrono;
+
+/// @brief Struct to hold the coordinates of a quadrant.
+struct Quadrant
+{
+	int y1, x1, y2, x2;
+};
+
+/// @brief Struct to hold the mean and variance of a region.
+struct RegionStatistics
+{
+	double mean = 0.0;
+	double variance = DBL_MAX;
+};
+
+/// @brief One entry of the integral image: the sum and the square sum of all pixels above and to the left.
+/// @details Both sums are stored next to each other, so that one corner of a region is read from one record.
+/// The sums are unsigned integers and are allowed to wrap around: the four corner combination of a region is computed
+/// modulo 2^bits as well, so it is still exact as long as the sums of the region itself fit (see IntegralTraits).
+template <typename Value>
+struct IntegralRecord
+{
+	Value sum;
+	Value sqSum;
+};
+
+/// @brief Integral value type for each supported pixel type.
+/// 8-bit: 32-bit sums, a region of up to maxRegionPixels pixels can be summed exactly.
+/// 16-bit: 64-bit sums, exact for any region.
+template <typename Pixel>
+struct IntegralTraits;
+
+template <>
+struct IntegralTraits<uchar>
+{
+	using Value = uint32_t;
+	static constexpr long long maxRegionPixels = UINT32_MAX / (255LL * 255LL);
+};
+
+template <>
+struct IntegralTraits<ushort>
+{
+	using Value = uint64_t;
+	static constexpr long long maxRegionPixels = LLONG_MAX;
+};
+
+/// @brief One entry of the colour integral image: the sums of the three channels, and the sum and square sum of the
+/// luminance. The quadrant is picked by the luminance variance, so the channels do not need square sums.
+struct ColourIntegralRecord
+{
+	uint32_t blueSum;
+	uint32_t greenSum;
+	uint32_t redSum;
+	uint32_t lumaSum;
+	uint32_t lumaSqSum;
+};
+
+/// @brief Integral image (Summed Area Table) with one extra row and column of zeros.
+template <typename Value, typename Record = IntegralRecord<Value>>
+struct IntegralImage
+{
+	using ValueType = Value;
+	using RecordType = Record;
+
+	int rows = 0;
+	int cols = 0;
+	vector<Record> records;
+
+	Record *ptr(int row) { return records.data() + static_cast<size_t>(row) * cols; }
+	const Record *ptr(int row) const { return records.data() + static_cast<size_t>(row) * cols; }
+};
+
+/// @brief Integral image rows kept in a ring buffer, for streaming. Row r is stored at r % rows.
+/// @details Only the last rows rows are valid, which is enough when the image is processed from top to bottom.
+template <typename Value, typename Record = IntegralRecord<Value>>
+struct IntegralWindow
+{
+	using ValueType = Value;
+	using RecordType = Record;
+
+	int rows = 0;
+	int cols = 0;
+	vector<Record> records;
+
+	Record *ptr(int row) { return records.data() + static_cast<size_t>(row % rows) * cols; }
+	const Record *ptr(int row) const { return records.data() + static_cast<size_t>(row % rows) * cols; }
+};
+
+/// @brief Calculate the mean and variance of a region.
+/// @details The region is defined by the top-left and bottom-right corners.
+/// The mean and variance are calculated using the integral images.
+/// The mean is calculated as:
+/// mean = sum / numberOfPixels
+/// The variance is calculated as:
+/// variance = (sqSum / numberOfPixels) - (mean * mean)
+/// The sums are exact integers, so the result is the same as with double precision integral images.
+/// @param top integral image row quad.y1
+/// @param bottom integral image row quad.y2 + 1
+/// @param quad quadrant
+/// @return RegionStatistics
+template <typename Value>
+RegionStatistics calculateRegionStatistics(const IntegralRecord<Value> *top, const IntegralRecord<Value> *bottom, const Quadrant &quad)
+{
+	RegionStatistics stats;
+
+	if (quad.y1 >= quad.y2 || quad.x1 >= quad.x2)
+	{
+		return stats;
+	}
+
+	int numberOfPixels = (quad.y2 - quad.y1 + 1) * (quad.x2 - quad.x1 + 1);
+
+	Value sum = bottom[quad.x2 + 1].sum - top[quad.x2 + 1].sum - bottom[quad.x1].sum + top[quad.x1].sum;
+	Value sqSum = bottom[quad.x2 + 1].sqSum - top[quad.x2 + 1].sqSum - bottom[quad.x1].sqSum + top[quad.x1].sqSum;
+
+	stats.mean = static_cast<double>(sum) / numberOfPixels;
+	stats.variance = (static_cast<double>(sqSum) / numberOfPixels) - (stats.mean * stats.mean);
+
+	return stats;
+}
+
+/// @brief Calculate the mean and variance of a region.
+/// @param integral integral image with the sum and square sum
+/// @param quad quadrant
+/// @return RegionStatistics
+template <typename Value>
+RegionStatistics calculateRegionStatistics(const IntegralImage<Value> &integral, const Quadrant &quad)
+{
+	return calculateRegionStatistics(integral.ptr(quad.y1), integral.ptr(quad.y2 + 1), quad);
+}
+
+/// @brief Struct to hold the rows and processing time of one thread's band.
+struct BandTiming
+{
+	int rowBegin = 0;
+	int rowEnd = 0;
+	double milliseconds = 0.0;
+};
+
+/// @brief Get quadrants of the image.
+/// @details The quadrants are defined as follows:
+/// A: Top-left, B: Top-right, C: Bottom-left, D: Bottom-right
+/// @param x column index
+/// @param y row index
+/// @param halfKernel half of the kernel size
+/// @param rows rows of the image
+/// @param cols columns of the image
+/// @return array of quadrants. A fixed size array so that no heap allocation is needed per pixel.
+inline array<Quadrant, 4> getQuadrants(int x, int y, int halfKernel, int rows, int cols)
+{
+	return {{
+			// A
+			{max(0, y - halfKernel), max(0, x - halfKernel), y, x},
+
+			// B
+			{max(0, y - halfKernel), x, y, min(cols - 1, x + halfKernel)},
+
+			// C
+			{y, max(0, x - halfKernel), min(rows - 1, y + halfKernel), x},
+
+			// D
+			{y, x, min(rows - 1, y + halfKernel), min(cols - 1, x + halfKernel)}}};
+}
+
+/// @brief Add one input row to the integral image.
+/// @details A running sum of the row is added to the record above, so the row is read and written once, in memory order.
+/// I(x,y) = I(x,y-1) + sum of row y up to x. (+1 because integral images have extra row/col)
+/// @param inputRow input row y
+/// @param cols columns of the input
+/// @param above integral image row y
+/// @param current integral image row y + 1. Its first record must be zero.
+template <typename Pixel, typename Value>
+void appendIntegralRow(const Pixel *inputRow, int cols, const IntegralRecord<Value> *above, IntegralRecord<Value> *current)
+{
+	Value rowSum = 0;
+	Value rowSqSum = 0;
+
+	// Iterate the width (cols) of the image
+	for (int x = 0; x < cols; x++)
+	{
+		Value pixel = inputRow[x];
+		rowSum += pixel;
+		rowSqSum += pixel * pixel;
+
+		current[x + 1].sum = above[x + 1].sum + rowSum;
+		current[x + 1].sqSum = above[x + 1].sqSum + rowSqSum;
+	}
+}
+
+/// @brief Calculate Integral Image and Sqaure Integraal Image. (Summed Area Tables (SAT))
+/// @details SAT tables will be used to calculate the mean and variances of regions in Kuwahara Filter
+/// The details of the algorithm can be found in https://en.wikipedia.org/wiki/Summed-area_table#:~:text=In%20the%20image%20processing%20domain,Crow%20for%20use%20with%20mipmaps.
+/// Both tables are filled in a single pass over the input.
+/// e.g arguments - ./src/kuwahara limes.tif output1.jpg 5
+/// e.g. arguments for debugging - ./src/kuwahara debug output1.jpg 5
+/// An integral image of the same size is reused without allocating, e.g. for the frames of a video.
+/// @param input input Image to calculate Sum and Square Sum images
+/// @param integral output integral image
+template <typename Pixel>
+void calculateIntegralImages(const Mat &input, IntegralImage<typename IntegralTraits<Pixel>::Value> &integral)
+{
+	using Value = typename IntegralTraits<Pixel>::Value;
+
+	// When creating the integral image, it is convenient to create a matrix (or IplImage)
+	// with one extra column and one extra row, both initialised to zero. This is to avoid when x or y becomes -1
+	// The zero row and column are never written, so they only have to be cleared when the size changes.
+	if (integral.rows != input.rows + 1 || integral.cols != input.cols + 1)
+	{
+		integral.rows = input.rows + 1;
+		integral.cols = input.cols + 1;
+		integral.records.assign(static_cast<size_t>(integral.rows) * integral.cols, IntegralRecord<Value>{0, 0});
+	}
+
+	// Fill integral images row by row. Iterate the height (rows) first
+	for (int y = 0; y < input.rows; y++)
+	{
+		appendIntegralRow(input.ptr<Pixel>(y), input.cols, integral.ptr(y), integral.ptr(y + 1));
+	}
+}
+
+/// @brief Pointers to the four integral image rows read by the quadrants of output row y, clamped to the image.
+/// top = max(0, y - halfKernel), centre = y, centreNext = y + 1, bottom = min(rows, y + halfKernel + 1)
+/// Quadrants A and B read top and centreNext, quadrants C and D read centre and bottom.
+template <typename Value, typename Record = IntegralRecord<Value>>
+struct IntegralRows
+{
+	const Record *top, *centre, *centreNext, *bottom;
+};
+
+/// @brief Get the integral image rows read by output row y.
+/// @param integral IntegralImage or IntegralWindow
+/// @param y row index
+/// @param halfKernelSize half of the kernel size
+/// @param rows rows of the image
+/// @return IntegralRows
+template <typename Table>
+IntegralRows<typename Table::ValueType, typename Table::RecordType> getIntegralRows(const Table &integral, int y, int halfKernelSize, int rows)
+{
+	return {integral.ptr(max(0, y - halfKernelSize)), integral.ptr(y), integral.ptr(y + 1), integral.ptr(min(rows, y + halfKernelSize + 1))};
+}
+
+/// @brief Calculate the Kuwahara output of a single pixel with the quadrants clamped to the image.
+/// @details Used for the border pixels, where the quadrants can be smaller or empty.
+/// @param integralRows integral image rows of row y
+/// @param x column index
+/// @param y row index
+/// @param halfKernelSize half of the kernel size
+/// @param rows rows of the image
+/// @param cols columns of the image
+/// @return mean of the region with the smallest variance
+template <typename Value>
+double kuwaharaPixel(const IntegralRows<Value> &integralRows, int x, int y, int halfKernelSize, int rows, int cols)
+{
+	// Calculate mean and variance for each region
+	double minVariance = DBL_MAX;
+	double meanWithSmallestVariance = 0.0;
+	array<Quadrant, 4> quadrants = getQuadrants(x, y, halfKernelSize, rows, cols);
+
+	// Loop through quadrants. A and B are above the pixel, C and D below.
+	for (int i = 0; i < 4; i++)
+	{
+		RegionStatistics stats = i < 2 ? calculateRegionStatistics(integralRows.top, integralRows.centreNext, quadrants[i])
+																	 : calculateRegionStatistics(integralRows.centre, integralRows.bottom, quadrants[i]);
+
+		if (stats.variance < minVariance)
+		{
+			minVariance = stats.variance;
+			meanWithSmallestVariance = stats.mean;
+		}
+	}
+
+	return meanWithSmallestVariance;
+}
+
+#if CV_SIMD_64F
+/// @brief Calculate the mean and variance of the windows [start, start + halfKernelSize] of one band of integral image
+/// rows, for every start in [startBegin, startEnd).
+/// @details The records are de-interleaved into sums and square sums, and the region sums are computed in wrapping
+/// 32-bit arithmetic like calculateRegionStatistics(). The rest is the same double precision operations in the same
+/// order, so the result is bit-identical. The last starts that do not fill a vector are computed one by one.
+/// @param row0 integral image row y1
+/// @param row1 integral image row y2 + 1
+/// @param halfKernelSize half of the kernel size: a window is halfKernelSize + 1 columns wide
+/// @param startBegin first left column
+/// @param startEnd one past the last left column
+/// @param means output mean of every window
+/// @param variances output variance of every window
+inline void calculateWindowStatisticsSimd(const IntegralRecord<uint32_t> *row0, const IntegralRecord<uint32_t> *row1, int halfKernelSize,
+																					int startBegin, int startEnd, double *means, double *variances)
+{
+	const int lanes = VTraits<v_float64>::vlanes();
+	const int startsPerIteration = VTraits<v_uint32>::vlanes();
+	const int pixelCount = (halfKernelSize + 1) * (halfKernelSize + 1);
+	const v_float64 pixelCountVector = vx_setall_f64(pixelCount);
+
+	int start = startBegin;
+	for (; start + startsPerIteration <= startEnd; start += startsPerIteration)
+	{
+		v_uint32 sum00, sqSum00, sum01, sqSum01, sum10, sqSum10, sum11, sqSum11;
+		v_load_deinterleave(reinterpret_cast<const unsigned *>(row0 + start), sum00, sqSum00);
+		v_load_deinterleave(reinterpret_cast<const unsigned *>(row0 + start + halfKernelSize + 1), sum01, sqSum01);
+		v_load_deinterleave(reinterpret_cast<const unsigned *>(row1 + start), sum10, sqSum10);
+		v_load_deinterleave(reinterpret_cast<const unsigned *>(row1 + start + halfKernelSize + 1), sum11, sqSum11);
+
+		// The region sums are below 2^31 (checked by the caller), so they can be converted as signed integers
+		v_int32 sum = v_reinterpret_as_s32(v_add(v_sub(v_sub(sum11, sum01), sum10), sum00));
+		v_int32 sqSum = v_reinterpret_as_s32(v_add(v_sub(v_sub(sqSum11, sqSum01), sqSum10), sqSum00));
+
+		v_float64 meanLow = v_div(v_cvt_f64(sum), pixelCountVector);
+		v_float64 meanHigh = v_div(v_cvt_f64_high(sum), pixelCountVector);
+		int index = start - startBegin;
+		v_store(means + index, meanLow);
+		v_store(means + index + lanes, meanHigh);
+		v_store(variances + index, v_sub(v_div(v_cvt_f64(sqSum), pixelCountVector), v_mul(meanLow, meanLow)));
+		v_store(variances + index + lanes, v_sub(v_div(v_cvt_f64_high(sqSum), pixelCountVector), v_mul(meanHigh, meanHigh)));
+	}
+
+	for (; start < startEnd; start++)
+	{
+		int right = start + halfKernelSize + 1;
+		uint32_t sum = row1[right].sum - row0[right].sum - row1[start].sum + row0[start].sum;
+		uint32_t sqSum = row1[right].sqSum - row0[right].sqSum - row1[start].sqSum + row0[start].sqSum;
+
+		int index = start - startBegin;
+		means[index] = static_cast<double>(sum) / pixelCount;
+		variances[index] = (static_cast<double>(sqSum) / pixelCount) - (means[index] * means[index]);
+	}
+}
+
+/// @brief Apply the Kuwahara Filter to the interior pixels [xBegin, xEnd) of one 8-bit row with OpenCV universal intrinsics.
+/// @details In the interior all four quadrants are full (halfKernelSize + 1)^2 squares, so no clamping is needed.
+/// Quadrant B of pixel x is quadrant A of pixel x + halfKernelSize, and D of x is C of x + halfKernelSize, so the
+/// statistics of every window of the upper and the lower band are computed once per row and every quadrant is a load.
+/// The quadrant with the minimum variance is then picked with v_select instead of branches. Strict less-than in the
+/// order A, B, C, D keeps the same tie-breaking as the scalar loop.
+/// The means and variances stay in double precision, so a vector holds VTraits<v_float64>::vlanes() pixels: 2 with SSE2
+/// and NEON, 4 with AVX2. The variances cannot be compared as floats or as integers n * sqSum - sum^2: equal variances
+/// of different means round differently in double, and the output has to pick the same quadrant as the original
+/// implementation. The gain comes from the shared windows and the branchless selection, see kuwahara_test.
+/// @param rows integral image rows of the output row
+/// @param outputRow output row
+/// @param halfKernelSize half of the kernel size
+/// @param xBegin first column, at least halfKernelSize
+/// @param xEnd one past the last column, at most cols - halfKernelSize
+/// @return first column that was not processed. The remaining pixels are left for the scalar path.
+inline int kuwaharaFilterRowSimd(const IntegralRows<uint32_t> &rows, uchar *outputRow, int halfKernelSize, int xBegin, int xEnd)
+{
+	const int lanes = VTraits<v_float64>::vlanes();
+
+	// Windows starting at xBegin - halfKernelSize (quadrant A of xBegin) up to xEnd - 1 (quadrant B of xEnd - 1).
+	// Reused by every row of the thread, so no allocation per row.
+	int windowCount = xEnd - xBegin + halfKernelSize;
+	thread_local vector<double> windowStatistics;
+	windowStatistics.resize(4 * static_cast<size_t>(windowCount));
+	double *upperMeans = windowStatistics.data();
+	double *upperVariances = upperMeans + windowCount;
+	double *lowerMeans = upperVariances + windowCount;
+	double *lowerVariances = lowerMeans + windowCount;
+
+	calculateWindowStatisticsSimd(rows.top, rows.centreNext, halfKernelSize, xBegin - halfKernelSize, xEnd, upperMeans, upperVariances);
+	calculateWindowStatisticsSimd(rows.centre, rows.bottom, halfKernelSize, xBegin - halfKernelSize, xEnd, lowerMeans, lowerVariances);
+
+	double means[VTraits<v_float64>::max_nlanes];
+	int x = xBegin;
+	for (; x + lanes <= xEnd; x += lanes)
+	{
+		// A: Top-left, B: Top-right, C: Bottom-left, D: Bottom-right
+		int left = x - xBegin;
+		int right = left + halfKernelSize;
+
+		// Branchless minimum
+		v_float64 minVariance = vx_load(upperVariances + left);
+		v_float64 mean = vx_load(upperMeans + left);
+
+		v_float64 variance = vx_load(upperVariances + right);
+		v_float64 smaller = v_lt(variance, minVariance);
+		minVariance = v_select(smaller, variance, minVariance);
+		mean = v_select(smaller, vx_load(upperMeans + right), mean);
+
+		variance = vx_load(lowerVariances + left);
+		smaller = v_lt(variance, minVariance);
+		minVariance = v_select(smaller, variance, minVariance);
+		mean = v_select(smaller, vx_load(lowerMeans + left), mean);
+
+		smaller = v_lt(vx_load(lowerVariances + right), minVariance);
+		mean = v_select(smaller, vx_load(lowerMeans + right), mean);
+
+		v_store(means, mean);
+		for (int i = 0; i < lanes; i++)
+		{
+			outputRow[x + i] = saturate_cast<uchar>(means[i]);
+		}
+	}
+
+	return x;
+}
+#endif
+
+/// @brief Apply the Kuwahara Filter to one output row.
+/// @details Interior pixels of 8-bit images go through the vectorized kernel when available, the rest through kuwaharaPixel().
+/// @param integralRows integral image rows of row y
+/// @param outputRow output row
+/// @param y row index
+/// @param halfKernelSize half of the kernel size
+/// @param rows rows of the image
+/// @param cols columns of the image
+template <typename Pixel>
+void kuwaharaFilterRow(const IntegralRows<typename IntegralTraits<Pixel>::Value> &integralRows, Pixel *outputRow, int y, int halfKernelSize, int rows, int cols)
+{
+	int x = 0;
+
+#if CV_SIMD_64F
+	// Interior of the image where no quadrant is clamped. The square sums of a quadrant have to fit in a signed 32-bit integer.
+	int interiorBegin = halfKernelSize;
+	int interiorEnd = cols - halfKernelSize;
+	bool fitsInt32 = (halfKernelSize + 1) * (halfKernelSize + 1) <= INT32_MAX / (255 * 255);
+
+	if constexpr (is_same<Pixel, uchar>::value)
+	{
+		if (fitsInt32 && y >= halfKernelSize && y + halfKernelSize < rows && interiorBegin < interiorEnd)
+		{
+			for (; x < interiorBegin; x++)
+			{
+				outputRow[x] = saturate_cast<Pixel>(kuwaharaPixel(integralRows, x, y, halfKernelSize, rows, cols));
+			}
+
+			x = kuwaharaFilterRowSimd(integralRows, outputRow, halfKernelSize, interiorBegin, interiorEnd);
+		}
+	}
+#endif
+
+	// Then columns
+	for (; x < cols; x++)
+	{
+		// Set output pixel to the mean of the region with the smallest variance
+		outputRow[x] = saturate_cast<Pixel>(kuwaharaPixel(integralRows, x, y, halfKernelSize, rows, cols));
+	}
+}
+
+/// @brief Apply the Kuwahara Filter to the rows [rowBegin, rowEnd) of the output image.
+/// @details Every output pixel only reads the shared integral images, so bands can be filtered independently.
+/// @param integral integral image
+/// @param output Output image, already allocated
+/// @param halfKernelSize half of the kernel size
+/// @param rowBegin first row of the band
+/// @param rowEnd one past the last row of the band
+template <typename Pixel>
+void kuwaharaFilterBand(const IntegralImage<typename IntegralTraits<Pixel>::Value> &integral, Mat &output, int halfKernelSize, int rowBegin, int rowEnd)
+{
+	// Rows
+	for (int y = rowBegin; y < rowEnd; y++)
+	{
+		kuwaharaFilterRow<Pixel>(getIntegralRows(integral, y, halfKernelSize, output.rows), output.ptr<Pixel>(y), y, halfKernelSize, output.rows, output.cols);
+	}
+}
+
+/// @brief Run body(rowBegin, rowEnd) on row bands, one per thread, and measure the time of each band.
+/// @details Deterministic partitioning: band i gets rows [rows * i / n, rows * (i + 1) / n).
+/// Band boundaries only depend on the number of rows and threads.
+/// @param rows number of rows
+/// @param threadCount number of threads. Never more bands than rows, so that every thread has work to do.
+/// @param body function filtering the rows of one band
+/// @return rows and processing time of each band
+inline vector<BandTiming> runRowBands(int rows, int threadCount, const function<void(int, int)> &body)
+{
+	int bandCount = max(1, min(threadCount, rows));
+	vector<BandTiming> bandTimings(bandCount);
+	vector<thread> workers;
+	workers.reserve(bandCount);
+
+	for (int band = 0; band < bandCount; band++)
+	{
+		BandTiming &timing = bandTimings[band];
+		timing.rowBegin = rows * band / bandCount;
+		timing.rowEnd = rows * (band + 1) / bandCount;
+
+		workers.emplace_back([&body, &timing]()
+												 {
+													 auto bandStart = high_resolution_clock::now();
+													 body(timing.rowBegin, timing.rowEnd);
+													 auto bandStop = high_resolution_clock::now();
+													 timing.milliseconds = duration_cast<microseconds>(bandStop - bandStart).count() / 1000.0;
+												 });
+	}
+
+	for (thread &worker : workers)
+	{
+		worker.join();
+	}
+
+	return bandTimings;
+}
+
+/// @brief Kuwahara Filter for one pixel type. See kuwaharaFilter().
+template <typename Pixel>
+void kuwaharaFilterTyped(const Mat &input, Mat &output, int kernelSize, int threadCount, vector<BandTiming> *timings)
+{
+	using Value = typename IntegralTraits<Pixel>::Value;
+
+	// Create output image
+	output = Mat(input.size(), input.type());
+	int halfKernelSize = kernelSize / 2;
+
+	// The integer sums are exact only while the sums of one quadrant fit
+	if (static_cast<long long>(halfKernelSize + 1) * (halfKernelSize + 1) > IntegralTraits<Pixel>::maxRegionPixels)
+	{
+		throw invalid_argument("Kernel size is too large for exact integral images");
+	}
+
+	// Calculate integral images already to improve performance
+	IntegralImage<Value> integral;
+	calculateIntegralImages<Pixel>(input, integral);
+
+	vector<BandTiming> bandTimings = runRowBands(input.rows, threadCount, [&](int rowBegin, int rowEnd)
+																							 { kuwaharaFilterBand<Pixel>(integral, output, halfKernelSize, rowBegin, rowEnd); });
+
+	if (timings != nullptr)
+	{
+		*timings = bandTimings;
+	}
+}
+
+/// @brief Integral image of an 8-bit BGR image.
+using ColourIntegralImage = IntegralImage<uint32_t, ColourIntegralRecord>;
+
+/// @brief Luminance of a BGR pixel, with the same fixed-point coefficients as cvtColor(COLOR_BGR2GRAY).
+/// A grey pixel (b = g = r) has its own value as luminance, so grey images pick the same quadrants as in grayscale mode.
+/// @param pixel BGR pixel
+/// @return luminance, 0 to 255
+inline uint32_t luminance(const Vec3b &pixel)
+{
+	return (pixel[0] * 1868u + pixel[1] * 9617u + pixel[2] * 4899u + (1u << 13)) >> 14;
+}
+
+/// @brief Sum of one field of the records over a region, from the four corners.
+/// @param top integral image row quad.y1
+/// @param bottom integral image row quad.y2 + 1
+/// @param quad quadrant
+/// @param field record field to sum
+/// @return region sum
+template <typename Record, typename Value>
+inline Value regionSum(const Record *top, const Record *bottom, const Quadrant &quad, Value Record::*field)
+{
+	return bottom[quad.x2 + 1].*field - top[quad.x2 + 1].*field - bottom[quad.x1].*field + top[quad.x1].*field;
+}
+
+/// @brief Add one BGR input row to the colour integral image.
+/// @details All five sums are built in the same pass over the interleaved BGR row. See appendIntegralRow().
+/// @param inputRow input row y
+/// @param cols columns of the input
+/// @param above integral image row y
+/// @param current integral image row y + 1. Its first record must be zero.
+inline void appendColourIntegralRow(const Vec3b *inputRow, int cols, const ColourIntegralRecord *above, ColourIntegralRecord *current)
+{
+	ColourIntegralRecord rowSum = {0, 0, 0, 0, 0};
+
+	for (int x = 0; x < cols; x++)
+	{
+		const Vec3b &pixel = inputRow[x];
+		uint32_t luma = luminance(pixel);
+		rowSum.blueSum += pixel[0];
+		rowSum.greenSum += pixel[1];
+		rowSum.redSum += pixel[2];
+		rowSum.lumaSum += luma;
+		rowSum.lumaSqSum += luma * luma;
+
+		current[x + 1].blueSum = above[x + 1].blueSum + rowSum.blueSum;
+		current[x + 1].greenSum = above[x + 1].greenSum + rowSum.greenSum;
+		current[x + 1].redSum = above[x + 1].redSum + rowSum.redSum;
+		current[x + 1].lumaSum = above[x + 1].lumaSum + rowSum.lumaSum;
+		current[x + 1].lumaSqSum = above[x + 1].lumaSqSum + rowSum.lumaSqSum;
+	}
+}
+
+/// @brief Calculate the colour integral image of an 8-bit BGR image in a single pass.
+/// @details Like calculateIntegralImages(), an integral image of the same size is reused without allocating.
+/// @param input BGR input image
+/// @param integral output colour integral image
+inline void calculateColourIntegralImage(const Mat &input, ColourIntegralImage &integral)
+{
+	if (integral.rows != input.rows + 1 || integral.cols != input.cols + 1)
+	{
+		integral.rows = input.rows + 1;
+		integral.cols = input.cols + 1;
+		integral.records.assign(static_cast<size_t>(integral.rows) * integral.cols, ColourIntegralRecord{0, 0, 0, 0, 0});
+	}
+
+	for (int y = 0; y < input.rows; y++)
+	{
+		appendColourIntegralRow(input.ptr<Vec3b>(y), input.cols, integral.ptr(y), integral.ptr(y + 1));
+	}
+}
+
+/// @brief Calculate the colour Kuwahara output of a single pixel.
+/// @details The quadrant is picked by the variance of the luminance, with the same clamping and tie-breaking as
+/// kuwaharaPixel(). Only the selected quadrant's channel means are calculated.
+/// @param integralRows colour integral image rows of row y
+/// @param x column index
+/// @param y row index
+/// @param halfKernelSize half of the kernel size
+/// @param rows rows of the image
+/// @param cols columns of the image
+/// @return per-channel means of the quadrant with the smallest luminance variance
+inline Vec3b kuwaharaColourPixel(const IntegralRows<uint32_t, ColourIntegralRecord> &integralRows, int x, int y, int halfKernelSize, int rows, int cols)
+{
+	double minVariance = DBL_MAX;
+	int selected = -1;
+	array<Quadrant, 4> quadrants = getQuadrants(x, y, halfKernelSize, rows, cols);
+
+	// A and B are above the pixel, C and D below
+	for (int i = 0; i < 4; i++)
+	{
+		const Quadrant &quad = quadrants[i];
+		if (quad.y1 >= quad.y2 || quad.x1 >= quad.x2)
+		{
+			continue;
+		}
+
+		const ColourIntegralRecord *top = i < 2 ? integralRows.top : integralRows.centre;
+		const ColourIntegralRecord *bottom = i < 2 ? integralRows.centreNext : integralRows.bottom;
+		int numberOfPixels = (quad.y2 - quad.y1 + 1) * (quad.x2 - quad.x1 + 1);
+
+		double mean = static_cast<double>(regionSum(top, bottom, quad, &ColourIntegralRecord::lumaSum)) / numberOfPixels;
+		double variance = (static_cast<double>(regionSum(top, bottom, quad, &ColourIntegralRecord::lumaSqSum)) / numberOfPixels) - (mean * mean);
+
+		if (variance < minVariance)
+		{
+			minVariance = variance;
+			selected = i;
+		}
+	}
+
+	if (selected < 0)
+	{
+		return Vec3b(0, 0, 0);
+	}
+
+	const Quadrant &quad = quadrants[selected];
+	const ColourIntegralRecord *top = selected < 2 ? integralRows.top : integralRows.centre;
+	const ColourIntegralRecord *bottom = selected < 2 ? integralRows.centreNext : integralRows.bottom;
+	double numberOfPixels = (quad.y2 - quad.y1 + 1) * (quad.x2 - quad.x1 + 1);
+
+	return Vec3b(saturate_cast<uchar>(regionSum(top, bottom, quad, &ColourIntegralRecord::blueSum) / numberOfPixels),
+							 saturate_cast<uchar>(regionSum(top, bottom, quad, &ColourIntegralRecord::greenSum) / numberOfPixels),
+							 saturate_cast<uchar>(regionSum(top, bottom, quad, &ColourIntegralRecord::redSum) / numberOfPixels));
+}
+
+/// @brief Apply the colour Kuwahara Filter to the rows [rowBegin, rowEnd) of the output image.
+/// @param integral colour integral image
+/// @param output BGR output image, already allocated
+/// @param halfKernelSize half of the kernel size
+/// @param rowBegin first row of the band
+/// @param rowEnd one past the last row of the band
+inline void kuwaharaColourFilterBand(const ColourIntegralImage &integral, Mat &output, int halfKernelSize, int rowBegin, int rowEnd)
+{
+	for (int y = rowBegin; y < rowEnd; y++)
+	{
+		auto integralRows = getIntegralRows(integral, y, halfKernelSize, output.rows);
+		Vec3b *outputRow = output.ptr<Vec3b>(y);
+
+		for (int x = 0; x < output.cols; x++)
+		{
+			outputRow[x] = kuwaharaColourPixel(integralRows, x, y, halfKernelSize, output.rows, output.cols);
+		}
+	}
+}
+
+/// @brief Colour Kuwahara Filter for 8-bit BGR images.
+/// @details One colour integral image holds the channel sums and the luminance statistics, so the input is read once
+/// and each pixel reads four records per quadrant, instead of running the grayscale filter on three split channels.
+/// @param input BGR input image
+/// @param output BGR output image
+/// @param kernelSize Kernel size
+/// @param threadCount Number of threads (row bands)
+/// @param timings Optional output of the rows and processing time of each band
+inline void kuwaharaColourFilter(const Mat &input, Mat &output, int kernelSize, int threadCount, vector<BandTiming> *timings)
+{
+	output = Mat(input.size(), input.type());
+	int halfKernelSize = kernelSize / 2;
+
+	if (static_cast<long long>(halfKernelSize + 1) * (halfKernelSize + 1) > IntegralTraits<uchar>::maxRegionPixels)
+	{
+		throw invalid_argument("Kernel size is too large for exact integral images");
+	}
+
+	ColourIntegralImage integral;
+	calculateColourIntegralImage(input, integral);
+
+	vector<BandTiming> bandTimings = runRowBands(input.rows, threadCount, [&](int rowBegin, int rowEnd)
+																							 { kuwaharaColourFilterBand(integral, output, halfKernelSize, rowBegin, rowEnd); });
+
+	if (timings != nullptr)
+	{
+		*timings = bandTimings;
+	}
+}
+
+/// @brief This works by four big four steps
+/// 1. Calculate the integral image and square integral image. Still Big O(n) time compexity.
+/// 2. Calculate the mean and variance of each region
+/// 3. Find the region with the smallest variance
+/// 4. Set the output pixel to the mean of the region with the smallest variance
+/// Steps 2-4 are split into row bands, one per thread. Each pixel is computed the same way as in a single thread,
+/// so the output is bit-identical for any thread count.
+/// 8-bit images use 32-bit integral images and 16-bit images use 64-bit ones, both exact.
+/// 8-bit BGR images go through kuwaharaColourFilter().
+/// @param input Input image, 8-bit or 16-bit single channel, or 8-bit BGR
+/// @param output Output image, same type as the input
+/// @param kernelSize Kernel size
+/// @param threadCount Number of threads (row bands)
+/// @param timings Optional output of the rows and processing time of each band
+inline void kuwaharaFilter(const Mat &input, Mat &output, int kernelSize, int threadCount = 1, vector<BandTiming> *timings = nullptr)
+{
+	if (input.type() == CV_8UC1)
+	{
+		kuwaharaFilterTyped<uchar>(input, output, kernelSize, threadCount, timings);
+	}
+	else if (input.type() == CV_16UC1)
+	{
+		kuwaharaFilterTyped<ushort>(input, output, kernelSize, threadCount, timings);
+	}
+	else if (input.type() == CV_8UC3)
+	{
+		kuwaharaColourFilter(input, output, kernelSize, threadCount, timings);
+	}
+	else
+	{
+		throw invalid_argument("Only 8-bit and 16-bit single channel and 8-bit BGR images are supported");
+	}
+}
+
+/// @brief Reusable Kuwahara Filter for a stream of frames, e.g. a video or a camera.
+/// @details The context owns every buffer of the filter: the grayscale frame, the integral image and the output.
+/// They are sized by the first frame and reused for every later frame of the same size, and the worker threads are
+/// started once and woken for each frame. After the first frame, apply() does not allocate.
+/// Band b of every frame gets rows [rows * b / n, rows * (b + 1) / n), band 0 runs on the calling thread.
+struct KuwaharaContext
+{
+	int kernelSize = 0;
+	bool colour = false;
+
+	// Frame buffers
+	Mat grey;
+	Mat output;
+	IntegralImage<uint32_t> integral;
+	ColourIntegralImage colourIntegral;
+
+	// Rows and processing time of each band of the last frame
+	vector<BandTiming> bandTimings;
+
+	// Number of frames, and of frames after the first one whose buffers had to be allocated again
+	int frameCount = 0;
+	int reallocationCount = 0;
+
+	/// @param kernelSize Kernel size
+	/// @param threadCount Number of threads (row bands)
+	/// @param colour filter BGR frames in colour instead of converting them to grayscale
+	KuwaharaContext(int kernelSize, int threadCount, bool colour)
+			: kernelSize(kernelSize), colour(colour), bandTimings(max(1, threadCount))
+	{
+		int halfKernelSize = kernelSize / 2;
+		if (static_cast<long long>(halfKernelSize + 1) * (halfKernelSize + 1) > IntegralTraits<uchar>::maxRegionPixels)
+		{
+			throw invalid_argument("Kernel size is too large for exact integral images");
+		}
+
+		for (size_t band = 1; band < bandTimings.size(); band++)
+		{
+			workers.emplace_back(&KuwaharaContext::workerLoop, this, static_cast<int>(band));
+		}
+	}
+
+	~KuwaharaContext()
+	{
+		{
+			lock_guard<mutex> lock(poolMutex);
+			stopping = true;
+		}
+		frameReady.notify_all();
+
+		for (thread &worker : workers)
+		{
+			worker.join();
+		}
+	}
+
+	KuwaharaContext(const KuwaharaContext &) = delete;
+	KuwaharaContext &operator=(const KuwaharaContext &) = delete;
+
+	/// @brief Filter one frame.
+	/// @param frame 8-bit BGR or grayscale frame
+	/// @return filtered frame, valid until the next call
+	const Mat &apply(const Mat &frame)
+	{
+		if (frame.depth() != CV_8U || (frame.channels() != 1 && frame.channels() != 3))
+		{
+			throw invalid_argument("Only 8-bit grayscale and BGR frames are supported");
+		}
+
+		const void *buffers[] = {grey.data, output.data, integral.records.data(), colourIntegral.records.data()};
+
+		// The integral image is built on this thread, like in kuwaharaFilter()
+		rows = frame.rows;
+		useColour = colour && frame.channels() == 3;
+		if (useColour)
+		{
+			calculateColourIntegralImage(frame, colourIntegral);
+			output.create(frame.size(), CV_8UC3);
+		}
+		else
+		{
+			const Mat *input = &frame;
+			if (frame.channels() == 3)
+			{
+				cvtColor(frame, grey, COLOR_BGR2GRAY);
+				input = &grey;
+			}
+
+			calculateIntegralImages<uchar>(*input, integral);
+			output.create(frame.size(), CV_8UC1);
+		}
+
+		const void *reusedBuffers[] = {grey.data, output.data, integral.records.data(), colourIntegral.records.data()};
+		if (frameCount > 0 && !equal(begin(buffers), end(buffers), begin(reusedBuffers)))
+		{
+			reallocationCount++;
+		}
+		frameCount++;
+
+		// Wake the workers, filter band 0 and wait for the others
+		{
+			lock_guard<mutex> lock(poolMutex);
+			pendingBands = static_cast<int>(workers.size());
+			generation++;
+		}
+		frameReady.notify_all();
+
+		filterBand(0);
+
+		unique_lock<mutex> lock(poolMutex);
+		bandsDone.wait(lock, [this]()
+									 { return pendingBands == 0; });
+
+		return output;
+	}
+
+private:
+	vector<thread> workers;
+	mutex poolMutex;
+	condition_variable frameReady;
+	condition_variable bandsDone;
+	long long generation = 0;
+	int pendingBands = 0;
+	bool stopping = false;
+
+	// Current frame, set by apply() before the workers are woken
+	int rows = 0;
+	bool useColour = false;
+
+	/// @brief Filter the rows of one band of the current frame and measure its time.
+	void filterBand(int band)
+	{
+		int bandCount = static_cast<int>(bandTimings.size());
+		BandTiming &timing = bandTimings[band];
+		timing.rowBegin = rows * band / bandCount;
+		timing.rowEnd = rows * (band + 1) / bandCount;
+
+		auto bandStart = high_resolution_clock::now();
+		if (useColour)
+		{
+			kuwaharaColourFilterBand(colourIntegral, output, kernelSize / 2, timing.rowBegin, timing.rowEnd);
+		}
+		else
+		{
+			kuwaharaFilterBand<uchar>(integral, output, kernelSize / 2, timing.rowBegin, timing.rowEnd);
+		}
+		auto bandStop = high_resolution_clock::now();
+		timing.milliseconds = duration_cast<microseconds>(bandStop - bandStart).count() / 1000.0;
+	}
+
+	/// @brief Worker thread of one band: filter the band of every new frame until the context is destroyed.
+	void workerLoop(int band)
+	{
+		long long seenGeneration = 0;
+
+		while (true)
+		{
+			{
+				unique_lock<mutex> lock(poolMutex);
+				frameReady.wait(lock, [&]()
+												{ return stopping || generation != seenGeneration; });
+
+				if (stopping)
+				{
+					return;
+				}
+				seenGeneration = generation;
+			}
+
+			filterBand(band);
+
+			{
+				lock_guard<mutex> lock(poolMutex);
+				if (--pendingBands == 0)
+				{
+					bandsDone.notify_one();
+				}
+			}
+		}
+	}
+};
+
+/// @brief Kuwahara Filter with several kernel sizes for one pixel type. See kuwaharaFilterMulti().
+template <typename Pixel>
+void kuwaharaFilterMultiTyped(const Mat &input, vector<Mat> &outputs, const vector<int> &kernelSizes, int threadCount, vector<BandTiming> *timings)
+{
+	using Value = typename IntegralTraits<Pixel>::Value;
+
+	int largestKernelSize = *max_element(kernelSizes.begin(), kernelSizes.end());
+	if (static_cast<long long>(largestKernelSize / 2 + 1) * (largestKernelSize / 2 + 1) > IntegralTraits<Pixel>::maxRegionPixels)
+	{
+		throw invalid_argument("Kernel size is too large for exact integral images");
+	}
+
+	outputs.resize(kernelSizes.size());
+	for (Mat &output : outputs)
+	{
+		output = Mat(input.size(), input.type());
+	}
+
+	// One integral image for all kernel sizes
+	IntegralImage<Value> integral;
+	calculateIntegralImages<Pixel>(input, integral);
+
+	vector<BandTiming> bandTimings = runRowBands(input.rows, threadCount, [&](int rowBegin, int rowEnd)
+																							 {
+																								 for (int y = rowBegin; y < rowEnd; y++)
+																								 {
+																									 for (size_t i = 0; i < kernelSizes.size(); i++)
+																									 {
+																										 int halfKernelSize = kernelSizes[i] / 2;
+																										 kuwaharaFilterRow<Pixel>(getIntegralRows(integral, y, halfKernelSize, input.rows), outputs[i].ptr<Pixel>(y), y, halfKernelSize, input.rows, input.cols);
+																									 }
+																								 }
+																							 });
+
+	if (timings != nullptr)
+	{
+		*timings = bandTimings;
+	}
+}
+
+/// @brief Apply the Kuwahara Filter with several kernel sizes in a single sweep.
+/// @details The integral image is built once. Each row is then filtered with every kernel size before moving to the
+/// next row, so the integral image rows around it are still in cache. The outputs are identical to separate
+/// kuwaharaFilter() runs.
+/// @param input Input image, 8-bit or 16-bit single channel
+/// @param outputs Output images, one per kernel size
+/// @param kernelSizes Kernel sizes
+/// @param threadCount Number of threads (row bands)
+/// @param timings Optional output of the rows and processing time of each band
+inline void kuwaharaFilterMulti(const Mat &input, vector<Mat> &outputs, const vector<int> &kernelSizes, int threadCount = 1, vector<BandTiming> *timings = nullptr)
+{
+	if (input.type() == CV_8UC1)
+	{
+		kuwaharaFilterMultiTyped<uchar>(input, outputs, kernelSizes, threadCount, timings);
+	}
+	else if (input.type() == CV_16UC1)
+	{
+		kuwaharaFilterMultiTyped<ushort>(input, outputs, kernelSizes, threadCount, timings);
+	}
+	else
+	{
+		throw invalid_argument("Several kernel sizes are only supported for 8-bit and 16-bit single channel images");
+	}
+}
+
+/// @brief Input, output and settings of a filtered image, kept for incremental updates after edits.
+struct KuwaharaState
+{
+	Mat input;
+	Mat output;
+	int kernelSize = 0;
+	int threadCount = 1;
+};
+
+/// @brief Filter a whole image and keep the state for kuwaharaFilterUpdate().
+/// @param state output state
+/// @param input Input image, any type supported by kuwaharaFilter()
+/// @param kernelSize Kernel size
+/// @param threadCount Number of threads (row bands)
+inline void kuwaharaFilterInit(KuwaharaState &state, const Mat &input, int kernelSize, int threadCount = 1)
+{
+	state.input = input.clone();
+	state.kernelSize = kernelSize;
+	state.threadCount = threadCount;
+	kuwaharaFilter(state.input, state.output, kernelSize, threadCount);
+}
+
+/// @brief Update the filtered image after the pixels inside a dirty rectangle were edited.
+/// @details An edited pixel changes the output of the pixels up to halfKernelSize away, so only the dirty rectangle
+/// grown by halfKernelSize is recomputed. Those pixels read input pixels up to halfKernelSize further away, so the
+/// integral image is built for the dirty rectangle grown by 2 * halfKernelSize only, instead of patching the full one:
+/// an edit changes every integral image entry below and to the right of it, which is most of the image.
+/// Inside that window the quadrants are clamped exactly where the full image clamps them, and the region sums are
+/// exact integers either way, so the result is identical to filtering the whole edited image.
+/// The cost depends on the size of the dirty rectangle and the kernel, not on the size of the image.
+/// @param state state from kuwaharaFilterInit(), updated in place
+/// @param editedInput edited input image, same size and type as state.input. Only the dirty rectangle is read.
+/// @param dirty rectangle of the edited pixels
+/// @return rectangle of the output that was recomputed
+inline Rect kuwaharaFilterUpdate(KuwaharaState &state, const Mat &editedInput, const Rect &dirty)
+{
+	if (editedInput.size() != state.input.size() || editedInput.type() != state.input.type())
+	{
+		throw invalid_argument("The edited image must have the same size and type as the filtered image");
+	}
+
+	Rect imageRect(0, 0, state.input.cols, state.input.rows);
+	Rect dirtyRect = dirty & imageRect;
+	if (dirtyRect.empty())
+	{
+		return Rect();
+	}
+
+	editedInput(dirtyRect).copyTo(state.input(dirtyRect));
+
+	int halfKernelSize = state.kernelSize / 2;
+	Rect affected = Rect(dirtyRect.x - halfKernelSize, dirtyRect.y - halfKernelSize, dirtyRect.width + 2 * halfKernelSize, dirtyRect.height + 2 * halfKernelSize) & imageRect;
+	Rect window = Rect(affected.x - halfKernelSize, affected.y - halfKernelSize, affected.width + 2 * halfKernelSize, affected.height + 2 * halfKernelSize) & imageRect;
+
+	Mat windowOutput;
+	kuwaharaFilter(state.input(window), windowOutput, state.kernelSize, state.threadCount);
+	windowOutput(affected - window.tl()).copyTo(state.output(affected));
+
+	return affected;
+}
+
+/// @brief Smallest half kernel size of the adaptive Kuwahara filter. The local structure is measured on this window.
+const int adaptiveMinHalfKernelSize = 1;
+
+/// @brief Pick the half kernel size of one pixel for the adaptive Kuwahara filter.
+/// @details The variance of the smallest window around the pixel is compared to the variance of the whole image.
+/// Flat areas (local variance 0) get the largest window, a local variance equal to the global variance gets the
+/// middle size, and edges and fine texture go down to the smallest window.
+/// @param integral integral image
+/// @param x column index
+/// @param y row index
+/// @param maxHalfKernelSize largest half kernel size
+/// @param globalVariance variance of the whole image
+/// @return half kernel size
+template <typename Value>
+int adaptiveHalfKernelSize(const IntegralImage<Value> &integral, int x, int y, int maxHalfKernelSize, double globalVariance)
+{
+	int rows = integral.rows - 1;
+	int cols = integral.cols - 1;
+	int h = adaptiveMinHalfKernelSize;
+	Quadrant window = {max(0, y - h), max(0, x - h), min(rows - 1, y + h), min(cols - 1, x + h)};
+	double localVariance = calculateRegionStatistics(integral, window).variance;
+
+	if (localVariance <= 0.0)
+	{
+		return maxHalfKernelSize;
+	}
+
+	double flatness = globalVariance / (globalVariance + localVariance);
+	return h + cvRound((maxHalfKernelSize - h) * flatness);
+}
+
+/// @brief Adaptive Kuwahara Filter for one pixel type. See adaptiveKuwaharaFilter().
+template <typename Pixel>
+void adaptiveKuwaharaFilterTyped(const Mat &input, Mat &output, int kernelSize, int threadCount, vector<BandTiming> *timings)
+{
+	using Value = typename IntegralTraits<Pixel>::Value;
+
+	output = Mat(input.size(), input.type());
+	int maxHalfKernelSize = kernelSize / 2;
+
+	if (static_cast<long long>(maxHalfKernelSize + 1) * (maxHalfKernelSize + 1) > IntegralTraits<Pixel>::maxRegionPixels)
+	{
+		throw invalid_argument("Kernel size is too large for exact integral images");
+	}
+
+	// The sums of the whole image can wrap around in the integral image, so the global variance is taken separately
+	Scalar globalMean, globalStdDev;
+	meanStdDev(input, globalMean, globalStdDev);
+	double globalVariance = globalStdDev[0] * globalStdDev[0];
+
+	IntegralImage<Value> integral;
+	calculateIntegralImages<Pixel>(input, integral);
+
+	vector<BandTiming> bandTimings = runRowBands(input.rows, threadCount, [&](int rowBegin, int rowEnd)
+																							 {
+																								 for (int y = rowBegin; y < rowEnd; y++)
+																								 {
+																									 Pixel *outputRow = output.ptr<Pixel>(y);
+																									 for (int x = 0; x < input.cols; x++)
+																									 {
+																										 // Both the window size and the quadrants take a constant number of lookups
+																										 int h = adaptiveHalfKernelSize(integral, x, y, maxHalfKernelSize, globalVariance);
+																										 outputRow[x] = saturate_cast<Pixel>(kuwaharaPixel(getIntegralRows(integral, y, h, input.rows), x, y, h, input.rows, input.cols));
+																									 }
+																								 }
+																							 });
+
+	if (timings != nullptr)
+	{
+		*timings = bandTimings;
+	}
+}
+
+/// @brief Adaptive Kuwahara Filter: the kernel size is picked per pixel from the local structure.
+/// @details Large windows smooth flat areas, small windows keep edges and fine detail (Bartyzel, "Adaptive Kuwahara
+/// filter"). Every window size reads the same integral image, so the cost per pixel does not depend on kernelSize.
+/// This replaces running several fixed kernel sizes and blending them.
+/// @param input Input image, 8-bit or 16-bit single channel
+/// @param output Output image
+/// @param kernelSize Largest kernel size. The smallest is 3.
+/// @param threadCount Number of threads (row bands)
+/// @param timings Optional output of the rows and processing time of each band
+inline void adaptiveKuwaharaFilter(const Mat &input, Mat &output, int kernelSize, int threadCount = 1, vector<BandTiming> *timings = nullptr)
+{
+	if (input.type() == CV_8UC1)
+	{
+		adaptiveKuwaharaFilterTyped<uchar>(input, output, kernelSize, threadCount, timings);
+	}
+	else if (input.type() == CV_16UC1)
+	{
+		adaptiveKuwaharaFilterTyped<ushort>(input, output, kernelSize, threadCount, timings);
+	}
+	else
+	{
+		throw invalid_argument("The adaptive Kuwahara filter only supports 8-bit and 16-bit single channel images");
+	}
+}
+
+/// @brief One entry of the cross-guided integral image: the sums of the guide, its square, the input and the
+/// product of the guide and the input. Wraps around like IntegralRecord.
+template <typename Value>
+struct GuidedIntegralRecord
+{
+	Value guideSum;
+	Value guideSqSum;
+	Value inputSum;
+	Value productSum;
+};
+
+/// @brief One entry of the integral image of the guided filter coefficients a and b.
+struct CoefficientIntegralRecord
+{
+	double aSum;
+	double bSum;
+};
+
+/// @brief Record fields holding the sums of the guided filter. A self-guided filter reads the sum and square sum of
+/// a plain IntegralRecord for both the guide and the input.
+template <typename Record, typename Value>
+struct GuidedFields
+{
+	Value Record::*guideSum;
+	Value Record::*guideSqSum;
+	Value Record::*inputSum;
+	Value Record::*productSum;
+};
+
+/// @brief Get the centred box of a pixel, clamped to the image.
+/// @param x column index
+/// @param y row index
+/// @param radius half of the kernel size
+/// @param rows rows of the image
+/// @param cols columns of the image
+/// @return box, as a Quadrant
+inline Quadrant getBox(int x, int y, int radius, int rows, int cols)
+{
+	return {max(0, y - radius), max(0, x - radius), min(rows - 1, y + radius), min(cols - 1, x + radius)};
+}
+
+/// @brief Calculate the cross-guided integral image in a single pass over the guide and the input.
+/// @param guide guide image
+/// @param input input image, same size and type as the guide
+/// @param integral output integral image
+template <typename Pixel, typename Value>
+void calculateGuidedIntegralImage(const Mat &guide, const Mat &input, IntegralImage<Value, GuidedIntegralRecord<Value>> &integral)
+{
+	integral.rows = input.rows + 1;
+	integral.cols = input.cols + 1;
+	integral.records.assign(static_cast<size_t>(integral.rows) * integral.cols, GuidedIntegralRecord<Value>{0, 0, 0, 0});
+
+	for (int y = 0; y < input.rows; y++)
+	{
+		const Pixel *guideRow = guide.ptr<Pixel>(y);
+		const Pixel *inputRow = input.ptr<Pixel>(y);
+		const GuidedIntegralRecord<Value> *above = integral.ptr(y);
+		GuidedIntegralRecord<Value> *current = integral.ptr(y + 1);
+		GuidedIntegralRecord<Value> rowSum = {0, 0, 0, 0};
+
+		for (int x = 0; x < input.cols; x++)
+		{
+			Value guidePixel = guideRow[x];
+			Value inputPixel = inputRow[x];
+			rowSum.guideSum += guidePixel;
+			rowSum.guideSqSum += guidePixel * guidePixel;
+			rowSum.inputSum += inputPixel;
+			rowSum.productSum += guidePixel * inputPixel;
+
+			current[x + 1].guideSum = above[x + 1].guideSum + rowSum.guideSum;
+			current[x + 1].guideSqSum = above[x + 1].guideSqSum + rowSum.guideSqSum;
+			current[x + 1].inputSum = above[x + 1].inputSum + rowSum.inputSum;
+			current[x + 1].productSum = above[x + 1].productSum + rowSum.productSum;
+		}
+	}
+}
+
+/// @brief Guided filter on any integral image with the guide and input sums. See guidedFilter().
+template <typename Pixel, typename Value, typename Record>
+void guidedFilterTyped(const IntegralImage<Value, Record> &integral, const GuidedFields<Record, Value> &fields, const Mat &guide, Mat &output,
+											 int radius, double eps, int threadCount, vector<BandTiming> *timings)
+{
+	int rows = guide.rows;
+	int cols = guide.cols;
+	Mat a(guide.size(), CV_64F);
+	Mat b(guide.size(), CV_64F);
+
+	// 1. Linear coefficients of each window: p = a * I + b
+	vector<BandTiming> coefficientTimings = runRowBands(rows, threadCount, [&](int rowBegin, int rowEnd)
+																										 {
+																											 for (int y = rowBegin; y < rowEnd; y++)
+																											 {
+																												 double *aRow = a.ptr<double>(y);
+																												 double *bRow = b.ptr<double>(y);
+																												 for (int x = 0; x < cols; x++)
+																												 {
+																													 Quadrant box = getBox(x, y, radius, rows, cols);
+																													 const Record *top = integral.ptr(box.y1);
+																													 const Record *bottom = integral.ptr(box.y2 + 1);
+																													 double numberOfPixels = (box.y2 - box.y1 + 1) * (box.x2 - box.x1 + 1);
+
+																													 double guideMean = regionSum(top, bottom, box, fields.guideSum) / numberOfPixels;
+																													 double inputMean = regionSum(top, bottom, box, fields.inputSum) / numberOfPixels;
+																													 double guideVariance = regionSum(top, bottom, box, fields.guideSqSum) / numberOfPixels - guideMean * guideMean;
+																													 double covariance = regionSum(top, bottom, box, fields.productSum) / numberOfPixels - guideMean * inputMean;
+
+																													 // A flat guide window with eps = 0 has no slope, only the mean
+																													 double denominator = guideVariance + eps;
+																													 aRow[x] = denominator > 0.0 ? covariance / denominator : 0.0;
+																													 bRow[x] = inputMean - aRow[x] * guideMean;
+																												 }
+																											 }
+																										 });
+
+	// 2. Integral image of the coefficients, so that their window means are O(1) as well
+	IntegralImage<double, CoefficientIntegralRecord> coefficients;
+	coefficients.rows = rows + 1;
+	coefficients.cols = cols + 1;
+	coefficients.records.assign(static_cast<size_t>(coefficients.rows) * coefficients.cols, CoefficientIntegralRecord{0.0, 0.0});
+	for (int y = 0; y < rows; y++)
+	{
+		const double *aRow = a.ptr<double>(y);
+		const double *bRow = b.ptr<double>(y);
+		const CoefficientIntegralRecord *above = coefficients.ptr(y);
+		CoefficientIntegralRecord *current = coefficients.ptr(y + 1);
+		CoefficientIntegralRecord rowSum = {0.0, 0.0};
+
+		for (int x = 0; x < cols; x++)
+		{
+			rowSum.aSum += aRow[x];
+			rowSum.bSum += bRow[x];
+			current[x + 1].aSum = above[x + 1].aSum + rowSum.aSum;
+			current[x + 1].bSum = above[x + 1].bSum + rowSum.bSum;
+		}
+	}
+
+	// 3. Output q = mean(a) * I + mean(b) over the windows covering each pixel
+	output = Mat(guide.size(), guide.type());
+	vector<BandTiming> outputTimings = runRowBands(rows, threadCount, [&](int rowBegin, int rowEnd)
+																								{
+																									for (int y = rowBegin; y < rowEnd; y++)
+																									{
+																										const Pixel *guideRow = guide.ptr<Pixel>(y);
+																										Pixel *outputRow = output.ptr<Pixel>(y);
+																										for (int x = 0; x < cols; x++)
+																										{
+																											Quadrant box = getBox(x, y, radius, rows, cols);
+																											const CoefficientIntegralRecord *top = coefficients.ptr(box.y1);
+																											const CoefficientIntegralRecord *bottom = coefficients.ptr(box.y2 + 1);
+																											double numberOfPixels = (box.y2 - box.y1 + 1) * (box.x2 - box.x1 + 1);
+
+																											double aMean = regionSum(top, bottom, box, &CoefficientIntegralRecord::aSum) / numberOfPixels;
+																											double bMean = regionSum(top, bottom, box, &CoefficientIntegralRecord::bSum) / numberOfPixels;
+																											outputRow[x] = saturate_cast<Pixel>(aMean * guideRow[x] + bMean);
+																										}
+																									}
+																								});
+
+	// Both passes use the same bands, so their times add up per thread
+	if (timings != nullptr)
+	{
+		*timings = coefficientTimings;
+		for (size_t band = 0; band < timings->size(); band++)
+		{
+			(*timings)[band].milliseconds += outputTimings[band].milliseconds;
+		}
+	}
+}
+
+/// @brief Guided filter for one pixel type. See guidedFilter().
+template <typename Pixel>
+void guidedFilterDispatch(const Mat &input, const Mat &guide, Mat &output, int kernelSize, double eps, int threadCount, vector<BandTiming> *timings)
+{
+	using Value = typename IntegralTraits<Pixel>::Value;
+
+	if (static_cast<long long>(kernelSize) * kernelSize > IntegralTraits<Pixel>::maxRegionPixels)
+	{
+		throw invalid_argument("Kernel size is too large for exact integral images");
+	}
+
+	if (guide.empty())
+	{
+		// Self-guided: the guide and the input sums are the sum and square sum of the Kuwahara integral image
+		IntegralImage<Value> integral;
+		calculateIntegralImages<Pixel>(input, integral);
+		GuidedFields<IntegralRecord<Value>, Value> fields = {&IntegralRecord<Value>::sum, &IntegralRecord<Value>::sqSum, &IntegralRecord<Value>::sum, &IntegralRecord<Value>::sqSum};
+		guidedFilterTyped<Pixel>(integral, fields, input, output, kernelSize / 2, eps, threadCount, timings);
+	}
+	else
+	{
+		IntegralImage<Value, GuidedIntegralRecord<Value>> integral;
+		calculateGuidedIntegralImage<Pixel>(guide, input, integral);
+		GuidedFields<GuidedIntegralRecord<Value>, Value> fields = {&GuidedIntegralRecord<Value>::guideSum, &GuidedIntegralRecord<Value>::guideSqSum,
+																															 &GuidedIntegralRecord<Value>::inputSum, &GuidedIntegralRecord<Value>::productSum};
+		guidedFilterTyped<Pixel>(integral, fields, guide, output, kernelSize / 2, eps, threadCount, timings);
+	}
+}
+
+/// @brief Edge-preserving guided filter (He et al.) on integral images.
+/// @details In each kernelSize x kernelSize window the output is a linear function of the guide, a * I + b, fitted to
+/// the input by least squares with the regularisation eps. Every pixel averages a and b over the windows that cover
+/// it. The window sums of I, I^2, p and I * p come from one integral image and the means of a and b from a second one,
+/// so the time does not depend on the kernel size. Without a guide the input guides itself, and the plain Kuwahara
+/// integral image (sum and square sum) is all that is needed.
+/// @param input Input image p, 8-bit or 16-bit single channel
+/// @param guide Guide image I, same size and type as the input, or empty for the self-guided filter
+/// @param output Output image
+/// @param kernelSize Kernel size (window of radius kernelSize / 2)
+/// @param eps Regularisation, in squared pixel values. Edges with a variance well above eps are kept.
+/// @param threadCount Number of threads (row bands)
+/// @param timings Optional output of the rows and processing time of each band
+inline void guidedFilter(const Mat &input, const Mat &guide, Mat &output, int kernelSize, double eps, int threadCount = 1, vector<BandTiming> *timings = nullptr)
+{
+	if (!guide.empty() && (guide.size() != input.size() || guide.type() != input.type()))
+	{
+		throw invalid_argument("The guide must have the same size and type as the input");
+	}
+
+	if (input.type() == CV_8UC1)
+	{
+		guidedFilterDispatch<uchar>(input, guide, output, kernelSize, eps, threadCount, timings);
+	}
+	else if (input.type() == CV_16UC1)
+	{
+		guidedFilterDispatch<ushort>(input, guide, output, kernelSize, eps, threadCount, timings);
+	}
+	else
+	{
+		throw invalid_argument("The guided filter only supports 8-bit and 16-bit single channel images");
+	}
+}
+
+/// @brief Lee filter for one pixel type. See leeFilter().
+template <typename Pixel>
+void leeFilterTyped(const Mat &input, Mat &output, int kernelSize, double noiseVariance, int threadCount, vector<BandTiming> *timings)
+{
+	using Value = typename IntegralTraits<Pixel>::Value;
+
+	if (static_cast<long long>(kernelSize) * kernelSize > IntegralTraits<Pixel>::maxRegionPixels)
+	{
+		throw invalid_argument("Kernel size is too large for exact integral images");
+	}
+
+	int radius = kernelSize / 2;
+	int rows = input.rows;
+	int cols = input.cols;
+
+	IntegralImage<Value> integral;
+	calculateIntegralImages<Pixel>(input, integral);
+
+	// Without a given noise variance, use the mean of the local variances (like Matlab's wiener2)
+	if (noiseVariance < 0.0)
+	{
+		double varianceSum = 0.0;
+		for (int y = 0; y < rows; y++)
+		{
+			for (int x = 0; x < cols; x++)
+			{
+				Quadrant box = getBox(x, y, radius, rows, cols);
+				double numberOfPixels = (box.y2 - box.y1 + 1) * (box.x2 - box.x1 + 1);
+				double mean = regionSum(integral.ptr(box.y1), integral.ptr(box.y2 + 1), box, &IntegralRecord<Value>::sum) / numberOfPixels;
+				varianceSum += regionSum(integral.ptr(box.y1), integral.ptr(box.y2 + 1), box, &IntegralRecord<Value>::sqSum) / numberOfPixels - mean * mean;
+			}
+		}
+		noiseVariance = varianceSum / (static_cast<double>(rows) * cols);
+	}
+
+	output = Mat(input.size(), input.type());
+	vector<BandTiming> bandTimings = runRowBands(rows, threadCount, [&](int rowBegin, int rowEnd)
+																							 {
+																								 for (int y = rowBegin; y < rowEnd; y++)
+																								 {
+																									 const Pixel *inputRow = input.ptr<Pixel>(y);
+																									 Pixel *outputRow = output.ptr<Pixel>(y);
+																									 for (int x = 0; x < cols; x++)
+																									 {
+																										 Quadrant box = getBox(x, y, radius, rows, cols);
+																										 const IntegralRecord<Value> *top = integral.ptr(box.y1);
+																										 const IntegralRecord<Value> *bottom = integral.ptr(box.y2 + 1);
+																										 double numberOfPixels = (box.y2 - box.y1 + 1) * (box.x2 - box.x1 + 1);
+
+																										 double mean = regionSum(top, bottom, box, &IntegralRecord<Value>::sum) / numberOfPixels;
+																										 double variance = regionSum(top, bottom, box, &IntegralRecord<Value>::sqSum) / numberOfPixels - mean * mean;
+
+																										 // Flat windows (variance at the noise level) get the mean, edges keep the pixel. Without noise a
+																										 // window of zero variance is flat as well, and would otherwise divide 0 by 0.
+																										 double denominator = max(variance, noiseVariance);
+																										 double gain = denominator > 0.0 ? max(0.0, variance - noiseVariance) / denominator : 0.0;
+																										 outputRow[x] = saturate_cast<Pixel>(mean + gain * (inputRow[x] - mean));
+																									 }
+																								 }
+																							 });
+
+	if (timings != nullptr)
+	{
+		*timings = bandTimings;
+	}
+}
+
+/// @brief Local variance (Lee / Wiener) denoising filter on the Kuwahara integral image.
+/// @details Each pixel moves towards the mean of its kernelSize x kernelSize window by how much of the window
+/// variance is noise: output = mean + max(0, variance - noise) / max(variance, noise) * (input - mean).
+/// The window mean and variance are O(1) lookups, so the time does not depend on the kernel size.
+/// @param input Input image, 8-bit or 16-bit single channel
+/// @param output Output image
+/// @param kernelSize Kernel size
+/// @param noiseVariance Noise variance in squared pixel values, or negative to estimate it from the image
+/// @param threadCount Number of threads (row bands)
+/// @param timings Optional output of the rows and processing time of each band
+inline void leeFilter(const Mat &input, Mat &output, int kernelSize, double noiseVariance = -1.0, int threadCount = 1, vector<BandTiming> *timings = nullptr)
+{
+	if (input.type() == CV_8UC1)
+	{
+		leeFilterTyped<uchar>(input, output, kernelSize, noiseVariance, threadCount, timings);
+	}
+	else if (input.type() == CV_16UC1)
+	{
+		leeFilterTyped<ushort>(input, output, kernelSize, noiseVariance, threadCount, timings);
+	}
+	else
+	{
+		throw invalid_argument("The Lee filter only supports 8-bit and 16-bit single channel images");
+	}
+}
+
+/// @brief Largest kernel size of the approximate pyramid mode.
+const int maxApproximateKernelSize = 201;
+
+/// @brief Half kernel size aimed for on the coarse level of the approximate pyramid mode.
+const int pyramidCoarseHalfKernelSize = 4;
+
+/// @brief Downsampling factor of the approximate pyramid mode: the largest power of two that keeps the coarse half
+/// kernel size at least pyramidCoarseHalfKernelSize. 1 for small kernels.
+/// @param halfKernelSize half of the kernel size
+/// @return downsampling factor
+inline int pyramidFactor(int halfKernelSize)
+{
+	int factor = 1;
+	while (halfKernelSize / (factor * 2) >= pyramidCoarseHalfKernelSize)
+	{
+		factor *= 2;
+	}
+	return factor;
+}
+
+/// @brief Approximate Kuwahara Filter for large kernels on a downsampled pyramid level.
+/// @details The image and its square are downsampled by pyramidFactor() with INTER_AREA, so each coarse pixel holds
+/// the mean of f and f^2 of its block. The four quadrant means and variances are computed on the coarse level with box
+/// filters of the scaled kernel, clamped to the image like the exact filter, and the 8 maps are upsampled back with
+/// INTER_LINEAR. Each full resolution pixel then picks the quadrant with the smallest upsampled variance (ties in the
+/// order A, B, C, D) and gets its upsampled mean. The result is smoother than the exact filter, see the readme.
+/// @param input Input image, 8-bit or 16-bit single channel
+/// @param output Output image, same type as the input
+/// @param kernelSize Kernel size, up to maxApproximateKernelSize
+/// @param threadCount Number of threads (row bands) for the quadrant selection
+inline void pyramidKuwaharaFilter(const Mat &input, Mat &output, int kernelSize, int threadCount = 1)
+{
+	if (input.type() != CV_8UC1 && input.type() != CV_16UC1)
+	{
+		throw invalid_argument("The approximate Kuwahara filter only supports 8-bit and 16-bit single channel images");
+	}
+
+	int halfKernelSize = kernelSize / 2;
+	int factor = pyramidFactor(halfKernelSize);
+	int coarseHalfKernelSize = max(1, cvRound(static_cast<double>(halfKernelSize) / factor));
+	Size coarseSize((input.cols + factor - 1) / factor, (input.rows + factor - 1) / factor);
+
+	// Block means of f and f^2. Double precision, as the variance subtracts two large numbers for 16-bit images.
+	Mat values, coarseValues, coarseSquares;
+	input.convertTo(values, CV_64F);
+	resize(values, coarseValues, coarseSize, 0, 0, INTER_AREA);
+	resize(values.mul(values), coarseSquares, coarseSize, 0, 0, INTER_AREA);
+
+	// The anchor is the position of the centre pixel in the quadrant: A top-left, B top-right, C bottom-left, D bottom-right
+	Size quadrantSize(coarseHalfKernelSize + 1, coarseHalfKernelSize + 1);
+	array<Point, 4> anchors = {Point(coarseHalfKernelSize, coarseHalfKernelSize), Point(0, coarseHalfKernelSize), Point(coarseHalfKernelSize, 0), Point(0, 0)};
+	Mat ones = Mat::ones(coarseSize, CV_64F);
+	array<Mat, 4> means, variances;
+
+	for (int i = 0; i < 4; i++)
+	{
+		// Unnormalised sums with zeros outside, divided by the number of pixels inside the image
+		Mat sum, sqSum, count;
+		boxFilter(coarseValues, sum, -1, quadrantSize, anchors[i], false, BORDER_CONSTANT);
+		boxFilter(coarseSquares, sqSum, -1, quadrantSize, anchors[i], false, BORDER_CONSTANT);
+		boxFilter(ones, count, -1, quadrantSize, anchors[i], false, BORDER_CONSTANT);
+
+		Mat mean = sum / count;
+		Mat variance = sqSum / count - mean.mul(mean);
+
+		mean.convertTo(mean, CV_32F);
+		variance.convertTo(variance, CV_32F);
+		resize(mean, means[i], input.size(), 0, 0, INTER_LINEAR);
+		resize(variance, variances[i], input.size(), 0, 0, INTER_LINEAR);
+	}
+
+	Mat result(input.size(), CV_32F);
+	runRowBands(input.rows, threadCount, [&](int rowBegin, int rowEnd)
+							{
+								for (int y = rowBegin; y < rowEnd; y++)
+								{
+									float *resultRow = result.ptr<float>(y);
+									for (int x = 0; x < input.cols; x++)
+									{
+										float minVariance = FLT_MAX;
+										float meanWithSmallestVariance = 0.0f;
+										for (int i = 0; i < 4; i++)
+										{
+											float variance = variances[i].ptr<float>(y)[x];
+											if (variance < minVariance)
+											{
+												minVariance = variance;
+												meanWithSmallestVariance = means[i].ptr<float>(y)[x];
+											}
+										}
+										resultRow[x] = meanWithSmallestVariance;
+									}
+								} });
+
+	result.convertTo(output, input.type());
+}
+
+/// @brief Number of windows of the side window filter.
+const int sideWindowCount = 8;
+
+/// @brief Separable window weights of the side window filter.
+/// @details These are the side windows of Yin et al. (side window filtering), not the angular sectors of the
+/// generalized Kuwahara filter: the half planes E, N, W, S and the quadrants NE, NW, SW, SE, with the centre pixel on
+/// their edge. Each half plane is the union of two quadrants, so the windows overlap heavily. In exchange every weight
+/// is a product w(dx) * w(dy) of one-dimensional kernels, and a window is one row pass and one column pass instead of a
+/// k x k convolution. Along each axis the kernels are the Gaussian G with sigma = radius / 2, the Gaussian P times a
+/// smooth step of a quarter radius towards the positive side, and N = G - P towards the negative side. The centre pixel
+/// belongs half to each side of a step, so to every window.
+/// As N = G - P, every window is a sum of the four products GG, GP, PG and PP with coefficients of +-1, scaled so that
+/// the window sums to 1. Only those four products have to be filtered.
+struct SideWindowKernels
+{
+	int radius = 0;
+	array<vector<float>, 2> axis;													// G and P
+	array<array<float, 4>, sideWindowCount> coefficients; // Of GG, GP, PG, PP (row kernel, column kernel)
+};
+
+/// @brief Get the window weight kernels of the side window filter. Built once per kernel size.
+/// @param kernelSize Kernel size
+/// @return SideWindowKernels
+inline const SideWindowKernels &getSideWindowKernels(int kernelSize)
+{
+	static mutex cacheMutex;
+	static map<int, SideWindowKernels> cache;
+
+	lock_guard<mutex> lock(cacheMutex);
+	SideWindowKernels &kernels = cache[kernelSize];
+	if (!kernels.axis[0].empty())
+	{
+		return kernels;
+	}
+
+	int radius = kernelSize / 2;
+	double radialSigma = max(radius, 1) / 2.0;
+	double stepWidth = max(radius, 1) / 4.0;
+	kernels.radius = radius;
+
+	double gaussianSum = 0.0, positiveSum = 0.0;
+	for (int d = -radius; d <= radius; d++)
+	{
+		double gaussian = exp(-(d * d) / (2.0 * radialSigma * radialSigma));
+		double positive = gaussian / (1.0 + exp(-d / stepWidth));
+		kernels.axis[0].push_back(static_cast<float>(gaussian));
+		kernels.axis[1].push_back(static_cast<float>(positive));
+		gaussianSum += gaussian;
+		positiveSum += positive;
+	}
+
+	// G, P and N = G - P as coefficients of G and P, and their sums
+	const double sides[3][2] = {{1, 0}, {0, 1}, {1, -1}};
+	const double sideSums[3] = {gaussianSum, positiveSum, gaussianSum - positiveSum};
+
+	// E, NE, N, NW, W, SW, S, SE as (row kernel, column kernel). y grows downwards, so north is the negative side.
+	const int windows[sideWindowCount][2] = {{1, 0}, {1, 2}, {0, 2}, {2, 2}, {2, 0}, {2, 1}, {0, 1}, {1, 1}};
+	for (int k = 0; k < sideWindowCount; k++)
+	{
+		int row = windows[k][0];
+		int column = windows[k][1];
+		double total = sideSums[row] * sideSums[column];
+		for (int product = 0; product < 4; product++)
+		{
+			kernels.coefficients[k][product] = static_cast<float>(sides[row][product / 2] * sides[column][product % 2] / total);
+		}
+	}
+
+	return kernels;
+}
+
+/// @brief Index of a pixel outside [0, size) mirrored back into the image, like BORDER_REFLECT (fedcba|abcdef|fedcba).
+/// @param index pixel index
+/// @param size number of pixels
+/// @return index in [0, size)
+inline int reflectIndex(int index, int size)
+{
+	int period = 2 * size;
+	index %= period;
+	if (index < 0)
+	{
+		index += period;
+	}
+	return index < size ? index : period - 1 - index;
+}
+
+/// @brief accumulator[x] += weight * source[x] for x in [0, count), with OpenCV universal intrinsics when available.
+/// @param accumulator accumulated row
+/// @param source source row
+/// @param weight kernel tap
+/// @param count number of values
+inline void multiplyAccumulate(float *accumulator, const float *source, float weight, int count)
+{
+	int x = 0;
+#if CV_SIMD
+	const int lanes = VTraits<v_float32>::vlanes();
+	const v_float32 weightVector = vx_setall_f32(weight);
+	for (; x + lanes <= count; x += lanes)
+	{
+		v_store(accumulator + x, v_add(vx_load(accumulator + x), v_mul(weightVector, vx_load(source + x))));
+	}
+#endif
+	for (; x < count; x++)
+	{
+		accumulator[x] += weight * source[x];
+	}
+}
+
+/// @brief Apply the side window filter to the rows [rowBegin, rowEnd) of an interleaved float image.
+/// @details The row pass filters every channel and its square with G and P. Only the kernelSize rows read by the
+/// current output row are kept, in a ring. The column pass then filters those rows with G and P into the four products
+/// of SideWindowKernels, and every pixel blends its 8 windows from them in registers. Per pixel and channel this is
+/// 4 row taps and 8 column taps per kernel column, independent of the number of windows.
+/// @param image interleaved float image, rows x cols x channels, 1 to 4 channels
+/// @param rows rows of the image
+/// @param cols columns of the image
+/// @param channels channels of the image
+/// @param kernels getSideWindowKernels()
+/// @param result interleaved float output, same size as the image
+/// @param rowBegin first output row
+/// @param rowEnd output row after the last
+inline void sideWindowFilterBand(const float *image, int rows, int cols, int channels, const SideWindowKernels &kernels, float *result,
+																 int rowBegin, int rowEnd)
+{
+	const int maxChannels = 4;
+	const int radius = kernels.radius;
+	const int taps = 2 * radius + 1;
+
+	// Row pass: input row i is kept in slot (i - rowBegin + radius) % taps. Plane (kernel, channel, square) of a slot
+	// holds the channel (square 0) or the squared channel (square 1) filtered along the row with G (kernel 0) or P (kernel 1).
+	vector<float> ring(static_cast<size_t>(taps) * 2 * channels * 2 * cols);
+	auto plane = [&](int row, int kernel, int channel, int square)
+	{
+		size_t slot = static_cast<size_t>((row - rowBegin + radius) % taps);
+		return ring.data() + (((slot * 2 + kernel) * channels + channel) * 2 + square) * cols;
+	};
+
+	vector<float> padded(cols + 2 * radius), paddedSq(cols + 2 * radius);
+	auto filterRow = [&](int row)
+	{
+		const float *inputRow = image + static_cast<size_t>(reflectIndex(row, rows)) * cols * channels;
+		for (int c = 0; c < channels; c++)
+		{
+			for (int x = -radius; x < cols + radius; x++)
+			{
+				float value = inputRow[reflectIndex(x, cols) * channels + c];
+				padded[x + radius] = value;
+				paddedSq[x + radius] = value * value;
+			}
+
+			for (int kernel = 0; kernel < 2; kernel++)
+			{
+				float *filtered = plane(row, kernel, c, 0);
+				float *filteredSq = plane(row, kernel, c, 1);
+				fill(filtered, filtered + cols, 0.0f);
+				fill(filteredSq, filteredSq + cols, 0.0f);
+				for (int j = 0; j < taps; j++)
+				{
+					multiplyAccumulate(filtered, padded.data() + j, kernels.axis[kernel][j], cols);
+					multiplyAccumulate(filteredSq, paddedSq.data() + j, kernels.axis[kernel][j], cols);
+				}
+			}
+		}
+	};
+
+	for (int row = rowBegin - radius; row < rowBegin + radius; row++)
+	{
+		filterRow(row);
+	}
+
+	// Column pass: products row (product, channel, square) of one output row, product = 2 * row kernel + column kernel
+	vector<float> products(4 * static_cast<size_t>(channels) * 2 * cols);
+	auto productRow = [&](int product, int channel, int square)
+	{
+		return products.data() + ((static_cast<size_t>(product) * channels + channel) * 2 + square) * cols;
+	};
+
+	for (int y = rowBegin; y < rowEnd; y++)
+	{
+		// The slot of row y - radius - 1 is no longer read
+		filterRow(y + radius);
+
+		fill(products.begin(), products.end(), 0.0f);
+		for (int j = 0; j < taps; j++)
+		{
+			for (int product = 0; product < 4; product++)
+			{
+				for (int c = 0; c < channels; c++)
+				{
+					for (int square = 0; square < 2; square++)
+					{
+						multiplyAccumulate(productRow(product, c, square), plane(y - radius + j, product / 2, c, square), kernels.axis[product % 2][j], cols);
+					}
+				}
+			}
+		}
+
+		// Blend: mean m and s^2 = E[f^2] - m^2 (summed over the channels) of every window, weighted with
+		// 1 / (1 + s^q), q = 8, i.e. 1 / (1 + (s^2)^4)
+		float *resultRow = result + static_cast<size_t>(y) * cols * channels;
+		int x = 0;
+#if CV_SIMD
+		const int lanes = VTraits<v_float32>::vlanes();
+		const v_float32 zero = vx_setzero_f32();
+		const v_float32 one = vx_setall_f32(1.0f);
+		float blended[VTraits<v_float32>::max_nlanes];
+		for (; x + lanes <= cols; x += lanes)
+		{
+			v_float32 weightTotal = zero;
+			v_float32 weightedSum[maxChannels] = {zero, zero, zero, zero};
+			for (int k = 0; k < sideWindowCount; k++)
+			{
+				v_float32 variance = zero;
+				v_float32 means[maxChannels];
+				for (int c = 0; c < channels; c++)
+				{
+					v_float32 mean = zero, meanSq = zero;
+					for (int product = 0; product < 4; product++)
+					{
+						v_float32 coefficient = vx_setall_f32(kernels.coefficients[k][product]);
+						mean = v_add(mean, v_mul(coefficient, vx_load(productRow(product, c, 0) + x)));
+						meanSq = v_add(meanSq, v_mul(coefficient, vx_load(productRow(product, c, 1) + x)));
+					}
+					variance = v_add(variance, v_sub(meanSq, v_mul(mean, mean)));
+					means[c] = mean;
+				}
+
+				variance = v_max(variance, zero);
+				variance = v_mul(variance, variance);
+				v_float32 weight = v_div(one, v_add(one, v_mul(variance, variance)));
+				weightTotal = v_add(weightTotal, weight);
+				for (int c = 0; c < channels; c++)
+				{
+					weightedSum[c] = v_add(weightedSum[c], v_mul(means[c], weight));
+				}
+			}
+
+			for (int c = 0; c < channels; c++)
+			{
+				v_store(blended, v_div(weightedSum[c], weightTotal));
+				for (int i = 0; i < lanes; i++)
+				{
+					resultRow[(x + i) * channels + c] = blended[i];
+				}
+			}
+		}
+#endif
+		for (; x < cols; x++)
+		{
+			float weightTotal = 0.0f;
+			float weightedSum[maxChannels] = {0.0f, 0.0f, 0.0f, 0.0f};
+			for (int k = 0; k < sideWindowCount; k++)
+			{
+				float variance = 0.0f;
+				float means[maxChannels];
+				for (int c = 0; c < channels; c++)
+				{
+					float mean = 0.0f, meanSq = 0.0f;
+					for (int product = 0; product < 4; product++)
+					{
+						mean += kernels.coefficients[k][product] * productRow(product, c, 0)[x];
+						meanSq += kernels.coefficients[k][product] * productRow(product, c, 1)[x];
+					}
+					variance += meanSq - mean * mean;
+					means[c] = mean;
+				}
+
+				variance = max(variance, 0.0f);
+				variance *= variance;
+				float weight = 1.0f / (1.0f + variance * variance);
+				weightTotal += weight;
+				for (int c = 0; c < channels; c++)
+				{
+					weightedSum[c] += means[c] * weight;
+				}
+			}
+
+			for (int c = 0; c < channels; c++)
+			{
+				resultRow[x * channels + c] = weightedSum[c] / weightTotal;
+			}
+		}
+	}
+}
+
+/// @brief Side window Kuwahara filter: 8 Gaussian-weighted side windows, blended like the generalized Kuwahara filter.
+/// @details The square quadrants of kuwaharaFilter() give blocky artifacts. Here each of the 8 overlapping windows of
+/// getSideWindowKernels() gets a weighted mean m and variance s^2 = E[f^2] - m^2. Instead of picking one window, the
+/// output blends all of them with weights 1 / (1 + s^q), q = 8, which strongly favours the most uniform windows
+/// (Papari et al.). The windows are half planes and quadrants rather than angular sectors, which makes them separable:
+/// the cost is O(kernel size) per pixel instead of O(kernel size^2).
+/// Colour images use the sum of the channel variances, like the luminance in kuwaharaColourFilter().
+/// @param input Input image, 8-bit or 16-bit, 1 to 4 channels
+/// @param output Output image, same type as the input
+/// @param kernelSize Kernel size
+/// @param threadCount Number of threads (row bands)
+/// @param timings Optional output of the rows and processing time of each band
+inline void sideWindowFilter(const Mat &input, Mat &output, int kernelSize, int threadCount = 1, vector<BandTiming> *timings = nullptr)
+{
+	if ((input.depth() != CV_8U && input.depth() != CV_16U) || input.channels() > 4)
+	{
+		throw invalid_argument("The side window filter only supports 8-bit and 16-bit images with 1 to 4 channels");
+	}
+
+	const SideWindowKernels &kernels = getSideWindowKernels(kernelSize);
+
+	// The weights are tuned for 8-bit intensities, so 16-bit images are scaled to the same range
+	double scale = input.depth() == CV_16U ? 255.0 / 65535.0 : 1.0;
+
+	Mat image;
+	input.convertTo(image, CV_MAKETYPE(CV_32F, input.channels()), scale);
+	Mat result(image.size(), image.type());
+
+	// Every band runs its own row pass over the rows it reads, so the output does not depend on the number of threads
+	vector<BandTiming> bandTimings = runRowBands(image.rows, threadCount, [&](int rowBegin, int rowEnd)
+																							 { sideWindowFilterBand(image.ptr<float>(), image.rows, image.cols, image.channels(), kernels, result.ptr<float>(), rowBegin, rowEnd); });
+
+	result.convertTo(output, input.type(), 1.0 / scale);
+
+	if (timings != nullptr)
+	{
+		*timings = bandTimings;
+	}
+}
+
+/// @brief Read the next number of a PGM header, skipping whitespace and # comments.
+/// @param file PGM file
+/// @return header value
+inline int readPgmHeaderValue(istream &file)
+{
+	int character = file.peek();
+	while (character == '#' || isspace(character))
+	{
+		if (character == '#')
+		{
+			string comment;
+			getline(file, comment);
+		}
+		else
+		{
+			file.get();
+		}
+		character = file.peek();
+	}
+
+	int value = -1;
+	file >> value;
+	if (!file || value < 0)
+	{
+		throw invalid_argument("Invalid PGM header");
+	}
+	return value;
+}
+
+/// @brief Reads a binary PGM (P5) image from top to bottom, a strip of rows at a time.
+/// @details imread can only decode a whole image, so the streaming mode reads the raw PGM format directly.
+/// 16-bit PGM samples are big-endian.
+struct PgmStripReader
+{
+	ifstream file;
+	int rows = 0;
+	int cols = 0;
+	int maxValue = 0;
+	int rowsRead = 0;
+
+	/// @brief OpenCV type of a strip
+	int type() const { return maxValue > 255 ? CV_16UC1 : CV_8UC1; }
+
+	/// @brief Open the file and read the header
+	/// @param path PGM file path
+	void open(const string &path)
+	{
+		file.open(path, ios::binary);
+		if (!file.is_open())
+		{
+			throw invalid_argument("Input Image cannot be read: " + path);
+		}
+
+		char magic[2] = {};
+		file.read(magic, 2);
+		if (magic[0] != 'P' || magic[1] != '5')
+		{
+			throw invalid_argument("Streaming mode needs a binary PGM (P5) input: " + path);
+		}
+
+		cols = readPgmHeaderValue(file);
+		rows = readPgmHeaderValue(file);
+		maxValue = readPgmHeaderValue(file);
+
+		// A single whitespace character separates the header from the pixels
+		file.get();
+
+		if (rows == 0 || cols == 0 || maxValue == 0 || maxValue > 65535)
+		{
+			throw invalid_argument("Invalid PGM header: " + path);
+		}
+	}
+
+	/// @brief Read the next rows into the strip
+	/// @param strip strip buffer. Up to strip.rows rows are read.
+	/// @return number of rows read
+	int read(Mat &strip)
+	{
+		int count = min(strip.rows, rows - rowsRead);
+
+		for (int i = 0; i < count; i++)
+		{
+			file.read(strip.ptr<char>(i), static_cast<streamsize>(cols * strip.elemSize()));
+
+			if (type() == CV_16UC1)
+			{
+				ushort *row = strip.ptr<ushort>(i);
+				for (int x = 0; x < cols; x++)
+				{
+					row[x] = static_cast<ushort>((row[x] >> 8) | (row[x] << 8));
+				}
+			}
+		}
+
+		if (!file)
+		{
+			throw runtime_error("Input Image is truncated");
+		}
+
+		rowsRead += count;
+		return count;
+	}
+};
+
+/// @brief Writes a binary PGM (P5) image from top to bottom, a strip of rows at a time.
+struct PgmStripWriter
+{
+	ofstream file;
+	int cols = 0;
+	int maxValue = 0;
+	vector<uchar> rowBuffer;
+
+	/// @brief Create the file and write the header
+	/// @param path PGM file path
+	/// @param rows rows of the image
+	/// @param cols columns of the image
+	/// @param maxValue 255 for 8-bit, up to 65535 for 16-bit
+	void open(const string &path, int rows, int cols, int maxValue)
+	{
+		file.open(path, ios::binary);
+		if (!file.is_open())
+		{
+			throw invalid_argument("Output Image cannot be written: " + path);
+		}
+
+		this->cols = cols;
+		this->maxValue = maxValue;
+		rowBuffer.resize(static_cast<size_t>(cols) * 2);
+		file << "P5\n"
+				 << cols << " " << rows << "\n"
+				 << maxValue << "\n";
+	}
+
+	/// @brief Append the rows of the strip
+	/// @param strip strip of output rows
+	void write(const Mat &strip)
+	{
+		for (int i = 0; i < strip.rows; i++)
+		{
+			if (maxValue > 255)
+			{
+				// 16-bit samples are big-endian
+				const ushort *row = strip.ptr<ushort>(i);
+				for (int x = 0; x < cols; x++)
+				{
+					rowBuffer[2 * x] = static_cast<uchar>(row[x] >> 8);
+					rowBuffer[2 * x + 1] = static_cast<uchar>(row[x] & 0xff);
+				}
+				file.write(reinterpret_cast<const char *>(rowBuffer.data()), static_cast<streamsize>(cols) * 2);
+			}
+			else
+			{
+				file.write(strip.ptr<char>(i), cols);
+			}
+		}
+
+		if (!file)
+		{
+			throw runtime_error("Output Image cannot be written");
+		}
+	}
+};
+
+/// @brief Struct to hold the memory use and thread timings of the streaming mode.
+struct StreamStatistics
+{
+	size_t windowBytes = 0;
+	size_t stripBytes = 0;
+	vector<double> threadMilliseconds;
+};
+
+/// @brief Streaming Kuwahara Filter for one pixel type. See kuwaharaFilterStream().
+template <typename Pixel>
+void kuwaharaFilterStreamTyped(PgmStripReader &reader, PgmStripWriter &writer, int kernelSize, int stripRows, int threadCount, StreamStatistics &statistics)
+{
+	using Value = typename IntegralTraits<Pixel>::Value;
+
+	int rows = reader.rows;
+	int cols = reader.cols;
+	int halfKernelSize = kernelSize / 2;
+
+	if (static_cast<long long>(halfKernelSize + 1) * (halfKernelSize + 1) > IntegralTraits<Pixel>::maxRegionPixels)
+	{
+		throw invalid_argument("Kernel size is too large for exact integral images");
+	}
+
+	// The rows of one output row span kernelSize + 1 integral image rows. A whole strip is added before it is filtered.
+	IntegralWindow<Value> window;
+	window.rows = kernelSize + 1 + stripRows;
+	window.cols = cols + 1;
+	window.records.assign(static_cast<size_t>(window.rows) * window.cols, IntegralRecord<Value>{0, 0});
+
+	// The last strip also flushes the halfKernelSize rows that were waiting for rows below them
+	Mat inputStrip(stripRows, cols, reader.type());
+	Mat outputStrip(stripRows + halfKernelSize, cols, reader.type());
+
+	statistics.windowBytes = window.records.size() * sizeof(IntegralRecord<Value>);
+	statistics.stripBytes = inputStrip.total() * inputStrip.elemSize() + outputStrip.total() * outputStrip.elemSize();
+
+	int integralRowsDone = 0;
+	int nextOutputRow = 0;
+
+	while (nextOutputRow < rows)
+	{
+		int count = reader.read(inputStrip);
+		if (count == 0 && integralRowsDone < rows)
+		{
+			throw runtime_error("Input Image is truncated");
+		}
+
+		for (int i = 0; i < count; i++, integralRowsDone++)
+		{
+			appendIntegralRow(inputStrip.ptr<Pixel>(i), cols, window.ptr(integralRowsDone), window.ptr(integralRowsDone + 1));
+		}
+
+		// Output row y is complete once integral image row y + halfKernelSize + 1 is there
+		int readyRows = integralRowsDone == rows ? rows : max(0, integralRowsDone - halfKernelSize);
+		int firstRow = nextOutputRow;
+		int outputCount = readyRows - firstRow;
+
+		if (outputCount > 0)
+		{
+			vector<BandTiming> timings = runRowBands(outputCount, threadCount, [&](int rowBegin, int rowEnd)
+																							 {
+																								 for (int i = rowBegin; i < rowEnd; i++)
+																								 {
+																									 int y = firstRow + i;
+																									 kuwaharaFilterRow<Pixel>(getIntegralRows(window, y, halfKernelSize, rows), outputStrip.ptr<Pixel>(i), y, halfKernelSize, rows, cols);
+																								 }
+																							 });
+
+			// Sum the time of each thread over all strips
+			statistics.threadMilliseconds.resize(max(statistics.threadMilliseconds.size(), timings.size()));
+			for (size_t band = 0; band < timings.size(); band++)
+			{
+				statistics.threadMilliseconds[band] += timings[band].milliseconds;
+			}
+
+			writer.write(outputStrip.rowRange(0, outputCount));
+			nextOutputRow = readyRows;
+		}
+	}
+}
+
+/// @brief Apply the Kuwahara Filter to a PGM image of any height with bounded memory.
+/// @details The input is read in strips of stripRows rows. The integral image is kept in a rolling window of
+/// kernelSize + 1 + stripRows rows, and each output strip is written as soon as the rows below it are read.
+/// The integral sums wrap around (see IntegralRecord), so the window never overflows however tall the image is.
+/// The output is identical to kuwaharaFilter().
+/// @param inputPath binary PGM (P5) input, 8-bit or 16-bit
+/// @param outputPath binary PGM (P5) output, same depth as the input
+/// @param kernelSize Kernel size
+/// @param stripRows rows per strip
+/// @param threadCount Number of threads used for each strip
+/// @param statistics output memory use and thread timings
+inline void kuwaharaFilterStream(const string &inputPath, const string &outputPath, int kernelSize, int stripRows, int threadCount, StreamStatistics &statistics)
+{
+	PgmStripReader reader;
+	reader.open(inputPath);
+
+	PgmStripWriter writer;
+	writer.open(outputPath, reader.rows, reader.cols, reader.maxValue);
+
+	if (reader.type() == CV_8UC1)
+	{
+		kuwaharaFilterStreamTyped<uchar>(reader, writer, kernelSize, stripRows, threadCount, statistics);
+	}
+	else
+	{
+		kuwaharaFilterStreamTyped<ushort>(reader, writer, kernelSize, stripRows, threadCount, statistics);
+	}
+}
@@ -0,0 +1,561 @@
+#include <iostream>
+#include <iomanip>
+#include "kuwahara.hpp"
+#include <filesystem>
+
+// Regression and benchmark of the Kuwahara filter paths.
+// Every optimised path has to produce exactly the output of the original double precision implementation, on
+// limes.tif and on synthetic images, for every kernel size. The shipped limes_kuwahara{5..15}x{5..15}.tif images are
+// compared as well and have to stay within a stated tolerance. The adaptive, pyramid, guided, Lee and side window
+// filters are not compared with the reference, so they are checked on images with a known answer, like a constant
+// image and a step edge.
+// e.g. arguments - ./src/kuwahara_test .. 11
+
+/// @brief Struct to hold the result of one variant.
+struct VariantResult
+{
+	double maxDifference = 0.0;
+	double psnr = 0.0;
+	double medianMilliseconds = 0.0;
+	double p95Milliseconds = 0.0;
+};
+
+/// @brief Original double precision Kuwahara Filter, as it was before any optimisation. The reference of the test.
+/// @details Double integral images built with at<double>(), the quadrants of every pixel in a vector as getQuadrants()
+/// used to return them, and in the order A, B, C, D with a strict < comparison. Only single channel images.
+/// @param input Input image, 8-bit or 16-bit single channel
+/// @param output Output image
+/// @param kernelSize Kernel size
+template <typename Pixel>
+void referenceKuwaharaFilter(const Mat &input, Mat &output, int kernelSize)
+{
+	output = Mat(input.size(), input.type());
+	int halfKernelSize = kernelSize / 2;
+
+	Mat inputDoubleImage;
+	input.convertTo(inputDoubleImage, CV_64F);
+
+	Mat sumImage = Mat::zeros(input.rows + 1, input.cols + 1, CV_64F);
+	Mat sqSumImage = Mat::zeros(input.rows + 1, input.cols + 1, CV_64F);
+	for (int y = 0; y < input.rows; y++)
+	{
+		for (int x = 0; x < input.cols; x++)
+		{
+			double pixel = inputDoubleImage.at<double>(y, x);
+			sumImage.at<double>(y + 1, x + 1) = pixel + sumImage.at<double>(y, x + 1) + sumImage.at<double>(y + 1, x) - sumImage.at<double>(y, x);
+			sqSumImage.at<double>(y + 1, x + 1) = pixel * pixel + sqSumImage.at<double>(y, x + 1) + sqSumImage.at<double>(y + 1, x) - sqSumImage.at<double>(y, x);
+		}
+	}
+
+	for (int y = 0; y < input.rows; y++)
+	{
+		for (int x = 0; x < input.cols; x++)
+		{
+			double minVariance = DBL_MAX;
+			double meanWithSmallestVariance = 0.0;
+
+			array<Quadrant, 4> pixelQuadrants = getQuadrants(x, y, halfKernelSize, input.rows, input.cols);
+			vector<Quadrant> quadrants(pixelQuadrants.begin(), pixelQuadrants.end());
+			for (const Quadrant &quad : quadrants)
+			{
+				if (quad.y1 >= quad.y2 || quad.x1 >= quad.x2)
+				{
+					continue;
+				}
+
+				int numberOfPixels = (quad.y2 - quad.y1 + 1) * (quad.x2 - quad.x1 + 1);
+				double sum = sumImage.at<double>(quad.y2 + 1, quad.x2 + 1) - sumImage.at<double>(quad.y1, quad.x2 + 1) - sumImage.at<double>(quad.y2 + 1, quad.x1) + sumImage.at<double>(quad.y1, quad.x1);
+				double sqSum = sqSumImage.at<double>(quad.y2 + 1, quad.x2 + 1) - sqSumImage.at<double>(quad.y1, quad.x2 + 1) - sqSumImage.at<double>(quad.y2 + 1, quad.x1) + sqSumImage.at<double>(quad.y1, quad.x1);
+				double mean = sum / numberOfPixels;
+				double variance = (sqSum / numberOfPixels) - (mean * mean);
+
+				if (variance < minVariance)
+				{
+					minVariance = variance;
+					meanWithSmallestVariance = mean;
+				}
+			}
+
+			output.at<Pixel>(y, x) = saturate_cast<Pixel>(meanWithSmallestVariance);
+		}
+	}
+}
+
+/// @brief Run a variant repetitions times and compare its last output with the expected image.
+/// @param run function filtering the image into its argument
+/// @param expected expected output
+/// @param repetitions number of timed runs
+/// @return VariantResult
+VariantResult measureVariant(const function<void(Mat &)> &run, const Mat &expected, int repetitions)
+{
+	vector<double> milliseconds;
+	Mat output;
+
+	for (int i = 0; i < repetitions; i++)
+	{
+		auto startTime = high_resolution_clock::now();
+		run(output);
+		auto stopTime = high_resolution_clock::now();
+		milliseconds.push_back(duration_cast<microseconds>(stopTime - startTime).count() / 1000.0);
+	}
+
+	sort(milliseconds.begin(), milliseconds.end());
+
+	VariantResult result;
+	result.maxDifference = norm(output, expected, NORM_INF);
+	result.psnr = PSNR(output, expected, expected.depth() == CV_16U ? 65535.0 : 255.0);
+	result.medianMilliseconds = milliseconds[milliseconds.size() / 2];
+	result.p95Milliseconds = milliseconds[min(milliseconds.size() - 1, milliseconds.size() * 95 / 100)];
+	return result;
+}
+
+/// @brief Print one result line.
+/// @param image image name
+/// @param kernelSize Kernel size
+/// @param variant variant name
+/// @param result VariantResult
+/// @param passed whether the variant passed
+void printResult(const string &image, int kernelSize, const string &variant, const VariantResult &result, bool passed)
+{
+	cout << left << setw(16) << image << right << setw(4) << kernelSize << "  " << left << setw(14) << variant << right
+			 << setw(10) << result.maxDifference << setw(10) << fixed << setprecision(2) << result.psnr
+			 << setw(10) << setprecision(3) << result.medianMilliseconds << setw(10) << result.p95Milliseconds
+			 << defaultfloat << "  " << (passed ? "PASS" : "FAIL") << endl;
+}
+
+/// @brief Random image with a fixed seed, so that every run tests the same pixels.
+/// @param type CV_8UC1 or CV_16UC1
+/// @return 347x258 random image, the size of limes.tif
+Mat generateRandomImage(int type)
+{
+	Mat image(258, 347, type);
+	RNG rng(20250608);
+	rng.fill(image, RNG::UNIFORM, 0, type == CV_16UC1 ? 65536 : 256);
+	return image;
+}
+
+/// @brief Diagonal gradient, where many quadrants have equal variances and the tie-breaking matters.
+/// @return 347x258 gradient image
+Mat generateGradientImage()
+{
+	Mat image(258, 347, CV_8UC1);
+	for (int y = 0; y < image.rows; y++)
+	{
+		for (int x = 0; x < image.cols; x++)
+		{
+			image.at<uchar>(y, x) = saturate_cast<uchar>((x + y) * 255 / (image.rows + image.cols - 2));
+		}
+	}
+	return image;
+}
+
+/// @brief Vertical step edge, the left half at low and the right half at high.
+/// @param low value of the left half
+/// @param high value of the right half
+/// @return 347x258 step image
+Mat generateStepImage(uchar low, uchar high)
+{
+	Mat image(258, 347, CV_8UC1, Scalar(low));
+	image.colRange(image.cols / 2, image.cols).setTo(high);
+	return image;
+}
+
+/// @brief Print one behaviour check.
+/// @param filter filter name
+/// @param check what is checked
+/// @param passed whether the check passed
+/// @return 1 if the check failed, else 0
+int reportCheck(const string &filter, const string &check, bool passed)
+{
+	cout << left << setw(16) << filter << setw(50) << check << right << (passed ? "PASS" : "FAIL") << endl;
+	return passed ? 0 : 1;
+}
+
+/// @brief Whether a filtered step image still has its edge: every pixel stays on its own side of the midpoint, and
+/// pixels farther than margin from the edge keep their value.
+/// @param output filtered generateStepImage()
+/// @param low value of the left half
+/// @param high value of the right half
+/// @param margin distance from the edge within which pixels may move
+/// @return true if the edge is preserved
+bool isStepPreserved(const Mat &output, uchar low, uchar high, int margin)
+{
+	int edge = output.cols / 2;
+	double midpoint = (low + high) / 2.0;
+	for (int y = 0; y < output.rows; y++)
+	{
+		const uchar *row = output.ptr<uchar>(y);
+		for (int x = 0; x < output.cols; x++)
+		{
+			bool left = x < edge;
+			int distance = left ? edge - 1 - x : x - edge;
+			if ((left && row[x] >= midpoint) || (!left && row[x] <= midpoint) || (distance >= margin && row[x] != (left ? low : high)))
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/// @brief Behaviour checks of the guided and the Lee filter: a constant image comes back unchanged, also without
+/// regularisation or noise, where a flat window divides 0 by 0, and a step edge is preserved.
+/// @param kernelSize Kernel size
+/// @return number of failed checks
+int testGuidedAndLeeFilters(int kernelSize)
+{
+	int failures = 0;
+	int threadCount = max(2u, thread::hardware_concurrency());
+	string name = "K " + to_string(kernelSize);
+	Mat constant(258, 347, CV_8UC1, Scalar(100));
+	Mat constant16(258, 347, CV_16UC1, Scalar(40000));
+	Mat step = generateStepImage(40, 200);
+	Mat output;
+
+	guidedFilter(constant, Mat(), output, kernelSize, 0.01 * 255 * 255, threadCount);
+	failures += reportCheck("guided " + name, "constant image unchanged", norm(output, constant, NORM_INF) == 0.0);
+	guidedFilter(constant, Mat(), output, kernelSize, 0.0, threadCount);
+	failures += reportCheck("guided " + name, "constant image unchanged with eps 0", norm(output, constant, NORM_INF) == 0.0);
+	guidedFilter(constant16, Mat(), output, kernelSize, 0.0, threadCount);
+	failures += reportCheck("guided " + name, "constant 16-bit image unchanged with eps 0", norm(output, constant16, NORM_INF) == 0.0);
+	guidedFilter(step, Mat(), output, kernelSize, 0.01 * 255 * 255, threadCount);
+	failures += reportCheck("guided " + name, "step edge preserved", isStepPreserved(output, 40, 200, kernelSize));
+	guidedFilter(step, step, output, kernelSize, 0.01 * 255 * 255, threadCount);
+	failures += reportCheck("guided " + name, "step edge preserved with a guide", isStepPreserved(output, 40, 200, kernelSize));
+
+	// The estimated noise of a constant image is 0 as well
+	leeFilter(constant, output, kernelSize, -1.0, threadCount);
+	failures += reportCheck("lee " + name, "constant image unchanged", norm(output, constant, NORM_INF) == 0.0);
+	leeFilter(constant, output, kernelSize, 0.0, threadCount);
+	failures += reportCheck("lee " + name, "constant image unchanged with noise 0", norm(output, constant, NORM_INF) == 0.0);
+	leeFilter(constant16, output, kernelSize, 0.0, threadCount);
+	failures += reportCheck("lee " + name, "constant 16-bit image unchanged with noise 0", norm(output, constant16, NORM_INF) == 0.0);
+	leeFilter(step, output, kernelSize, -1.0, threadCount);
+	failures += reportCheck("lee " + name, "step edge preserved", isStepPreserved(output, 40, 200, kernelSize));
+	leeFilter(step, output, kernelSize, 0.0, threadCount);
+	failures += reportCheck("lee " + name, "step image unchanged with noise 0", norm(output, step, NORM_INF) == 0.0);
+
+	return failures;
+}
+
+/// @brief Behaviour checks of the side window filter: a constant image comes back unchanged, the output does not
+/// depend on the number of threads, a step edge is preserved, and rotating the input by 90 degrees rotates the output.
+/// The rotated image is filtered along the other axis first, so float rounding may move a pixel by one level.
+/// @param limes limes.tif
+/// @param kernelSize Kernel size
+/// @return number of failed checks
+int testSideWindowFilter(const Mat &limes, int kernelSize)
+{
+	int failures = 0;
+	int threadCount = max(2u, thread::hardware_concurrency());
+	string name = "sidewindow K " + to_string(kernelSize);
+	Mat constant(258, 347, CV_8UC1, Scalar(100));
+	Mat constant16(258, 347, CV_16UC1, Scalar(40000));
+	Mat constantColour(258, 347, CV_8UC3, Scalar(30, 100, 220));
+	Mat step = generateStepImage(40, 200);
+	Mat output, threadedOutput, rotatedOutput;
+
+	sideWindowFilter(constant, output, kernelSize, threadCount);
+	failures += reportCheck(name, "constant image unchanged", norm(output, constant, NORM_INF) == 0.0);
+	sideWindowFilter(constant16, output, kernelSize, threadCount);
+	failures += reportCheck(name, "constant 16-bit image unchanged", norm(output, constant16, NORM_INF) == 0.0);
+	sideWindowFilter(constantColour, output, kernelSize, threadCount);
+	failures += reportCheck(name, "constant colour image unchanged", norm(output, constantColour, NORM_INF) == 0.0);
+	sideWindowFilter(step, output, kernelSize, threadCount);
+	failures += reportCheck(name, "step edge preserved", isStepPreserved(output, 40, 200, kernelSize));
+
+	sideWindowFilter(limes, output, kernelSize, 1);
+	sideWindowFilter(limes, threadedOutput, kernelSize, threadCount);
+	failures += reportCheck(name, "threads identical to 1 thread", norm(output, threadedOutput, NORM_INF) == 0.0);
+
+	Mat rotated, expected;
+	rotate(limes, rotated, ROTATE_90_CLOCKWISE);
+	sideWindowFilter(rotated, rotatedOutput, kernelSize, threadCount);
+	rotate(output, expected, ROTATE_90_CLOCKWISE);
+	failures += reportCheck(name, "symmetric under a 90 degree rotation", norm(rotatedOutput, expected, NORM_INF) <= 1.0);
+
+	return failures;
+}
+
+/// @brief Behaviour checks of the adaptive Kuwahara filter: a constant image and a step edge come back unchanged, as
+/// every window size picks a flat quadrant there, and the output does not depend on the number of threads. With kernel
+/// size 3 every pixel gets the smallest window, so the output is the fixed 3x3 filter.
+/// @param limes limes.tif
+/// @param kernelSize Kernel size
+/// @return number of failed checks
+int testAdaptiveFilter(const Mat &limes, int kernelSize)
+{
+	int failures = 0;
+	int threadCount = max(2u, thread::hardware_concurrency());
+	string name = "adaptive K " + to_string(kernelSize);
+	Mat constant(258, 347, CV_8UC1, Scalar(100));
+	Mat constant16(258, 347, CV_16UC1, Scalar(40000));
+	Mat step = generateStepImage(40, 200);
+	Mat output, threadedOutput;
+
+	adaptiveKuwaharaFilter(constant, output, kernelSize, threadCount);
+	failures += reportCheck(name, "constant image unchanged", norm(output, constant, NORM_INF) == 0.0);
+	adaptiveKuwaharaFilter(constant16, output, kernelSize, threadCount);
+	failures += reportCheck(name, "constant 16-bit image unchanged", norm(output, constant16, NORM_INF) == 0.0);
+	adaptiveKuwaharaFilter(step, output, kernelSize, threadCount);
+	failures += reportCheck(name, "step image unchanged", norm(output, step, NORM_INF) == 0.0);
+
+	adaptiveKuwaharaFilter(limes, output, kernelSize, 1);
+	adaptiveKuwaharaFilter(limes, threadedOutput, kernelSize, threadCount);
+	failures += reportCheck(name, "threads identical to 1 thread", norm(output, threadedOutput, NORM_INF) == 0.0);
+
+	if (kernelSize == 3)
+	{
+		Mat fixedOutput;
+		kuwaharaFilter(limes, fixedOutput, kernelSize, 1);
+		failures += reportCheck(name, "identical to the fixed filter", norm(output, fixedOutput, NORM_INF) == 0.0);
+	}
+
+	return failures;
+}
+
+/// @brief Behaviour checks of the approximate pyramid filter: a constant image comes back unchanged, the output does
+/// not depend on the number of threads, and a step edge stays sharp. The quadrants are picked from upsampled coarse
+/// maps, so pixels within two coarse pixels of the edge may move, but not across the midpoint.
+/// @param limes limes.tif
+/// @param kernelSize Kernel size
+/// @return number of failed checks
+int testPyramidFilter(const Mat &limes, int kernelSize)
+{
+	int failures = 0;
+	int threadCount = max(2u, thread::hardware_concurrency());
+	string name = "pyramid K " + to_string(kernelSize);
+	Mat constant(258, 347, CV_8UC1, Scalar(100));
+	Mat constant16(258, 347, CV_16UC1, Scalar(40000));
+	Mat step = generateStepImage(40, 200);
+	Mat output, threadedOutput;
+
+	pyramidKuwaharaFilter(constant, output, kernelSize, threadCount);
+	failures += reportCheck(name, "constant image unchanged", norm(output, constant, NORM_INF) == 0.0);
+	pyramidKuwaharaFilter(constant16, output, kernelSize, threadCount);
+	failures += reportCheck(name, "constant 16-bit image unchanged", norm(output, constant16, NORM_INF) == 0.0);
+	pyramidKuwaharaFilter(step, output, kernelSize, threadCount);
+	failures += reportCheck(name, "step edge preserved", isStepPreserved(output, 40, 200, 2 * pyramidFactor(kernelSize / 2)));
+
+	pyramidKuwaharaFilter(limes, output, kernelSize, 1);
+	pyramidKuwaharaFilter(limes, threadedOutput, kernelSize, threadCount);
+	failures += reportCheck(name, "threads identical to 1 thread", norm(output, threadedOutput, NORM_INF) == 0.0);
+
+	return failures;
+}
+
+/// @brief Run every variant of one image and kernel size against the reference output.
+/// @param name image name
+/// @param input input image
+/// @param kernelSize Kernel size
+/// @param repetitions number of timed runs per variant
+/// @param temporaryDirectory directory for the streaming PGM files
+/// @return number of failed variants
+template <typename Pixel>
+int testImage(const string &name, const Mat &input, int kernelSize, int repetitions, const string &temporaryDirectory)
+{
+	int failures = 0;
+	int threadCount = max(2u, thread::hardware_concurrency());
+
+	Mat expected;
+	referenceKuwaharaFilter<Pixel>(input, expected, kernelSize);
+	VariantResult reference = measureVariant([&](Mat &output)
+																					 { referenceKuwaharaFilter<Pixel>(input, output, kernelSize); },
+																					 expected, 1);
+	printResult(name, kernelSize, "reference", reference, true);
+
+	map<string, function<void(Mat &)>> variants;
+	variants["1 thread"] = [&](Mat &output)
+	{ kuwaharaFilter(input, output, kernelSize, 1); };
+	variants["threads"] = [&](Mat &output)
+	{ kuwaharaFilter(input, output, kernelSize, threadCount); };
+	variants["multi-kernel"] = [&](Mat &output)
+	{
+		vector<Mat> outputs;
+		kuwaharaFilterMulti(input, outputs, {3, kernelSize}, threadCount);
+		output = outputs[1];
+	};
+	variants["incremental"] = [&](Mat &output)
+	{
+		// Filter a copy with an inverted rectangle, then restore the rectangle incrementally
+		Rect dirty(input.cols / 4, input.rows / 4, input.cols / 2, input.rows / 2);
+		Mat edited = input.clone();
+		bitwise_not(input(dirty), edited(dirty));
+
+		KuwaharaState state;
+		kuwaharaFilterInit(state, edited, kernelSize, threadCount);
+		kuwaharaFilterUpdate(state, input, dirty);
+		output = state.output;
+	};
+	variants["stream"] = [&](Mat &output)
+	{
+		string inputPath = temporaryDirectory + "/kuwahara_test_input.pgm";
+		string outputPath = temporaryDirectory + "/kuwahara_test_output.pgm";
+		{
+			PgmStripWriter writer;
+			writer.open(inputPath, input.rows, input.cols, input.depth() == CV_16U ? 65535 : 255);
+			writer.write(input);
+		}
+
+		StreamStatistics statistics;
+		kuwaharaFilterStream(inputPath, outputPath, kernelSize, 64, threadCount, statistics);
+
+		PgmStripReader reader;
+		reader.open(outputPath);
+		output = Mat(reader.rows, reader.cols, reader.type());
+		reader.read(output);
+	};
+
+	if (input.type() == CV_8UC1)
+	{
+		variants["context"] = [&](Mat &output)
+		{
+			KuwaharaContext context(kernelSize, threadCount, false);
+			context.apply(input);
+			output = context.apply(input).clone();
+		};
+		variants["colour"] = [&](Mat &output)
+		{
+			// Grey pixels have a luminance equal to their value, so every channel is the grayscale output
+			Mat colourInput, colourOutput;
+			cvtColor(input, colourInput, COLOR_GRAY2BGR);
+			kuwaharaFilter(colourInput, colourOutput, kernelSize, threadCount);
+			extractChannel(colourOutput, output, 1);
+		};
+	}
+
+	for (const auto &variant : variants)
+	{
+		VariantResult result = measureVariant(variant.second, expected, repetitions);
+		bool passed = result.maxDifference == 0.0;
+		printResult(name, kernelSize, variant.first, result, passed);
+		failures += passed ? 0 : 1;
+	}
+
+	return failures;
+}
+
+int main(int argc, char **argv)
+{
+	// The data directory holds limes.tif and the shipped references. Like the kuwahara tool, the default is ../
+	string dataDirectory = argc > 1 ? argv[1] : "..";
+	int repetitions = argc > 2 ? atoi(argv[2]) : 11;
+
+	try
+	{
+		Mat limes = imread(dataDirectory + "/limes.tif", IMREAD_GRAYSCALE);
+		if (limes.empty())
+		{
+			cerr << "!! " << dataDirectory << "/limes.tif cannot be read." << endl;
+			return 1;
+		}
+
+		Mat random = generateRandomImage(CV_8UC1);
+		Mat random16 = generateRandomImage(CV_16UC1);
+		Mat gradient = generateGradientImage();
+		Mat limes16;
+		limes.convertTo(limes16, CV_16U, 257);
+
+		string temporaryDirectory = filesystem::temp_directory_path().string();
+		int failures = 0;
+
+		cout << left << setw(16) << "Image" << right << setw(4) << "K" << "  " << left << setw(14) << "Variant" << right
+				 << setw(10) << "Max diff" << setw(10) << "PSNR" << setw(10) << "Median ms" << setw(10) << "P95 ms" << endl;
+
+		for (int kernelSize = 3; kernelSize <= 15; kernelSize += 2)
+		{
+			failures += testImage<uchar>("limes", limes, kernelSize, repetitions, temporaryDirectory);
+			failures += testImage<uchar>("random", random, kernelSize, repetitions, temporaryDirectory);
+			failures += testImage<uchar>("gradient", gradient, kernelSize, repetitions, temporaryDirectory);
+			failures += testImage<ushort>("limes 16-bit", limes16, kernelSize, repetitions, temporaryDirectory);
+			failures += testImage<ushort>("random 16-bit", random16, kernelSize, repetitions, temporaryDirectory);
+		}
+
+		cout << endl
+				 << "Filter behaviour" << endl;
+		for (int kernelSize = 3; kernelSize <= 15; kernelSize += 4)
+		{
+			failures += testAdaptiveFilter(limes, kernelSize);
+			failures += testGuidedAndLeeFilters(kernelSize);
+			failures += testSideWindowFilter(limes, kernelSize);
+		}
+		for (int kernelSize : {15, 63, maxApproximateKernelSize})
+		{
+			failures += testPyramidFilter(limes, kernelSize);
+		}
+
+		// Single thread speedup of the filter over the original implementation. Timings depend on the machine, so a
+		// speedup below the target is reported, and only one below the minimum fails. The vectorized path runs on 2 double
+		// lanes with SSE2; it measured 7x to 9x at -O2 and at least 3x unoptimised.
+		const double targetSpeedup = 4.0;
+		const double minSpeedup = 2.0;
+		cout << endl
+				 << "Single thread speedup on limes, target " << targetSpeedup << "x, minimum " << minSpeedup << "x" << endl;
+		for (int kernelSize = 3; kernelSize <= 15; kernelSize += 2)
+		{
+			Mat expected;
+			referenceKuwaharaFilter<uchar>(limes, expected, kernelSize);
+			VariantResult original = measureVariant([&](Mat &output)
+																							{ referenceKuwaharaFilter<uchar>(limes, output, kernelSize); },
+																							expected, repetitions);
+			VariantResult filter = measureVariant([&](Mat &output)
+																						{ kuwaharaFilter(limes, output, kernelSize, 1); },
+																						expected, repetitions);
+			double speedup = original.medianMilliseconds / max(filter.medianMilliseconds, 0.001);
+			cout << left << setw(16) << "limes" << right << setw(4) << kernelSize << "  " << fixed << setprecision(3)
+					 << setw(10) << original.medianMilliseconds << " ms -> " << setw(8) << filter.medianMilliseconds << " ms"
+					 << setprecision(2) << setw(8) << speedup << "x" << defaultfloat
+					 << (speedup < minSpeedup ? "  FAIL" : (speedup < targetSpeedup ? "  below target" : "")) << endl;
+			failures += speedup < minSpeedup ? 1 : 0;
+		}
+
+		// The shipped references were made with a different border handling, so they differ from the reference
+		// implementation in up to 5% of the pixels, mostly within the kernel radius of the border (PSNR 36-48 dB, at most
+		// 12 levels apart inside). Beyond the tolerance below the test fails; the filter must also stay exactly the
+		// reference implementation.
+		const double shippedMinPsnr = 35.0;
+		const double shippedMaxInteriorDifference = 16.0;
+		cout << endl
+				 << "Shipped references, min PSNR " << shippedMinPsnr << " dB, max difference inside the border "
+				 << shippedMaxInteriorDifference << endl;
+		for (int kernelSize = 5; kernelSize <= 15; kernelSize += 2)
+		{
+			string size = to_string(kernelSize);
+			Mat shipped = imread(dataDirectory + "/limes_kuwahara" + size + "x" + size + ".tif", IMREAD_GRAYSCALE);
+			if (shipped.empty())
+			{
+				cerr << "!! limes_kuwahara" << size << "x" << size << ".tif cannot be read." << endl;
+				failures++;
+				continue;
+			}
+
+			Mat expected;
+			referenceKuwaharaFilter<uchar>(limes, expected, kernelSize);
+			VariantResult result = measureVariant([&](Mat &output)
+																						{ kuwaharaFilter(limes, output, kernelSize, 1); },
+																						shipped, repetitions);
+
+			Mat output;
+			kuwaharaFilter(limes, output, kernelSize, 1);
+			Rect interior(kernelSize / 2, kernelSize / 2, limes.cols - kernelSize / 2 * 2, limes.rows - kernelSize / 2 * 2);
+			bool passed = result.psnr >= shippedMinPsnr && norm(output(interior), shipped(interior), NORM_INF) <= shippedMaxInteriorDifference &&
+										norm(output, expected, NORM_INF) == 0.0;
+			printResult("limes shipped", kernelSize, "1 thread", result, passed);
+			failures += passed ? 0 : 1;
+		}
+
+		cout << endl
+				 << (failures == 0 ? "All variants match the reference and every check passed." : to_string(failures) + " variants or checks failed.") << endl;
+		return failures == 0 ? 0 : 1;
+	}
+	catch (const cv::Exception &e)
+	{
+		cerr << "OpenCV Exception: " << e.what() << std::endl;
+		return 1;
+	}
+	catch (const std::exception &e)
+	{
+		cerr << "Standard Exception: " << e.what() << std::endl;
+		return 1;
+	}
+}